@@ -13,17 +13,50 @@
  *      build octree with e.g. leaf size = 5
  *      octree.build(5);
  *
+ *  the build sorts the points by Morton code in parallel (octree.build(5, num_threads)), octree.indices is then in
+ *  Morton order.
+ *
  *  if you want radius query for all points in a sphere around p with radius r call:
  *
  *      ResultSet results = octree.query_radius(p, r);
  *
- *  result.idx_dist_pair contains the indices (and dist is 0 for all points due to speed).
+ *  result.idx_dist_pair contains the indices and the squared distances to p.
+ *  To avoid the allocation per query, pass a buffer that is reused (cleared first) or a visitor:
+ *
+ *      std::vector<std::pair<size_t, float>> neighbours;
+ *      octree.query_radius(p, r, neighbours);
+ *      octree.visit_radius(p, r, [&](size_t idx, float squared_dist) { ... });
  *
  *  if you want knn query for k nearest neghbors of p call:
  *
  *      ResultSet results = octree.query_knn(p, k);
  *
- *  result.idx_dist_pair contains the indices (and dist is the actual distance for all points to the query point).
+ *  result.idx_dist_pair contains the indices (and dist is the actual distance for all points to the query point),
+ *  sorted by distance. The query visits the closest child first and keeps a bounded heap of k candidates, see
+ *  src/main_knn_benchmark.cpp for a comparison with nanoflann. octree.query_knn(p, k, results) reuses an existing
+ *  ResultSet.
+ *
+ *  All traversals use an explicit stack of fixed size (kNN a stack or priority queue kept in the ResultSet), there
+ *  is no recursion.
+ *
+ *  per-node aggregates (point count, centroid, sum of a per-point attribute) are computed bottom-up after build:
+ *
+ *      std::vector<PointAggregate> aggregates = octree.aggregate_points(attributes);
+ *
+ *  and give gaussian weighted neighbourhood sums with a far-field approximation (Barnes-Hut style):
+ *
+ *      GaussianSum sum = octree.gaussian_sum(aggregates, attributes, p, sigma, r, 0.05);
+ *      float smoothed = sum.weighted_sum / sum.weight;
+ *
+ *  Octree only references the points and has to be rebuilt when they change. DynamicOctree owns its points and is
+ *  updated in place (leaves split and merge), e.g. for appending scan patches and moving them during registration:
+ *
+ *      DynamicOctree dynamic(16);
+ *      size_t first_id = dynamic.insert(patch);
+ *      dynamic.transform(patch_ids, [&](const Vec3 &p) { return rotate(p) + shift; });
+ *      dynamic.remove(id);
+ *
+ *  see src/main_octree_update_benchmark.cpp for a comparison with rebuilding.
  *
  * */
 
@@ -34,6 +67,7 @@
 #include <cassert>
 #include <cstdint>
 #include <cmath>
+#include <algorithm>
 
 //namespace students {
 
@@ -189,6 +223,47 @@ struct AABB {
 };
 //----------------------------------------------------------------------------------------------------------------------
 
+// hash index from location code to storage index: open addressing with linear probing in a table of at least twice
+// the number of nodes. 0 is never a valid location code (the root is 1) and marks the empty slots.
+class LocCodeIndex {
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    template<class Nodes>
+    void assign(const Nodes &nodes) {
+        size_t bits = 1;
+        while ((size_t(1) << bits) < 2 * nodes.size()) ++bits;
+        shift = 64 - bits;
+        slots.assign(size_t(1) << bits, {0, npos});
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            size_t slot = hash(nodes[i].loc_code);
+            while (slots[slot].first != 0) slot = (slot + 1) & (slots.size() - 1);
+            slots[slot] = {nodes[i].loc_code, i};
+        }
+    }
+
+    size_t find(uint64_t loc_code) const {
+        if (slots.empty()) return npos;
+        for (size_t slot = hash(loc_code);; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].first == loc_code) return slots[slot].second;
+            if (slots[slot].first == 0) return npos;
+        }
+    }
+
+    void clear() { slots.clear(); }
+
+    bool empty() const { return slots.empty(); }
+
+private:
+    // fibonacci hashing, the top bits of the product depend on all bits of the code
+    size_t hash(uint64_t loc_code) const { return static_cast<size_t>((loc_code * 0x9E3779B97F4A7C15ull) >> shift); }
+
+    std::vector<std::pair<uint64_t, size_t>> slots;
+    size_t shift = 64;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
 template<class UserData>
 struct OctreeBase {
     struct Node {
@@ -210,6 +285,10 @@ struct OctreeBase {
     AABB root_aabb;
     container_t storage;
 
+    // results of a query. With k > 0 the set keeps the k closest candidates in a bounded max-heap (largest distance
+    // in front) and worst_dist is the distance a new candidate has to beat: max() until k candidates are stored,
+    // then the k-th best distance, so it only ever shrinks. k == 0 keeps everything. sort() finishes a query and
+    // orders the pairs by ascending distance; reset() before adding again.
     struct ResultSet {
         using points_item_t  = std::pair<Vec3, float>;
         using points_container_t = std::vector<points_item_t>;
@@ -218,30 +297,29 @@ struct OctreeBase {
         using iterator_t = index_container_t::iterator;
         using const_iterator_t = index_container_t::const_iterator;
 
+        // node waiting in a knn traversal, with the squared distance from the query point to its box
+        struct PendingNode {
+            float min_squared;
+            size_t index;
+            AABB aabb;
+        };
+
         points_container_t points_dist_pair;
         index_container_t idx_dist_pair;
         float worst_dist;
+        // pending nodes of query_knn, kept here so a reused result set does not allocate
+        std::vector<PendingNode> pending;
 
         ResultSet() : worst_dist(std::numeric_limits<float>::max()), k(0) {}
 
-        explicit ResultSet(size_t k) : worst_dist(0), k(k) {}
+        explicit ResultSet(size_t k) : worst_dist(std::numeric_limits<float>::max()), k(k) {}
 
         bool add_point(const Vec3 &point, float dist) {
-            if (!is_full() || dist < worst_dist) {
-                worst_dist = std::max(worst_dist, dist);
-                points_dist_pair.emplace_back(point, dist);
-                return true;
-            }
-            return false;
+            return add_bounded(points_dist_pair, points_item_t(point, dist));
         }
 
         bool add_point(size_t idx, float dist) {
-            if (!is_full() || dist < worst_dist) {
-                worst_dist = std::max(worst_dist, dist);
-                idx_dist_pair.emplace_back(idx, dist);
-                return true;
-            }
-            return false;
+            return add_bounded(idx_dist_pair, index_item_t(idx, dist));
         }
 
         bool add_point(size_t idx) {
@@ -250,32 +328,23 @@ struct OctreeBase {
         }
 
         void sort() {
-            if (!idx_dist_pair.empty()) {
-                std::sort(idx_dist_pair.begin(), idx_dist_pair.end(),
-                          [](const std::pair<size_t, float> &lhs, const std::pair<size_t, float> &rhs) {
-                              return lhs.second < rhs.second;
-                          });
-                if (is_full()) {
-                    idx_dist_pair.resize(k);
-                    worst_dist = idx_dist_pair.back().second;
-                }
-            }
-            if (!points_dist_pair.empty()) {
-                std::sort(points_dist_pair.begin(), points_dist_pair.end(),
-                          [](const std::pair<Vec3, float> &lhs, const std::pair<Vec3, float> &rhs) {
-                              return lhs.second < rhs.second;
-                          });
-                if (is_full()) {
-                    points_dist_pair.resize(k);
-                    worst_dist = points_dist_pair.back().second;
-                }
-            }
+            std::sort(idx_dist_pair.begin(), idx_dist_pair.end(), closer());
+            std::sort(points_dist_pair.begin(), points_dist_pair.end(), closer());
         }
 
         bool is_full() const {
             return idx_dist_pair.size() >= k || points_dist_pair.size() >= k;
         }
 
+        // empties the set for a new query with k results, the allocated capacity is kept
+        void reset(size_t new_k) {
+            points_dist_pair.clear();
+            idx_dist_pair.clear();
+            pending.clear();
+            k = new_k;
+            worst_dist = std::numeric_limits<float>::max();
+        }
+
         iterator_t begin() { return idx_dist_pair.begin(); }
 
         iterator_t end() { return idx_dist_pair.end(); }
@@ -286,6 +355,32 @@ struct OctreeBase {
 
     private:
         size_t k;
+
+        // a function object rather than a function pointer, so the heap and sort calls inline the comparison
+        struct closer {
+            template<class Item>
+            bool operator()(const Item &lhs, const Item &rhs) const { return lhs.second < rhs.second; }
+        };
+
+        template<class Item>
+        bool add_bounded(std::vector<Item> &heap, const Item &item) {
+            if (k == 0) {
+                heap.push_back(item);
+                return true;
+            }
+            if (heap.size() < k) {
+                heap.push_back(item);
+                std::push_heap(heap.begin(), heap.end(), closer());
+            } else {
+                if (!(item.second < worst_dist)) return false;
+                // replace the current worst candidate
+                std::pop_heap(heap.begin(), heap.end(), closer());
+                heap.back() = item;
+                std::push_heap(heap.begin(), heap.end(), closer());
+            }
+            if (heap.size() >= k) worst_dist = heap.front().second;
+            return true;
+        }
     };
 
     OctreeBase() = default;
@@ -295,6 +390,90 @@ struct OctreeBase {
     virtual void clear() {
         root_aabb = AABB();
         storage.clear();
+        node_index.clear();
+    }
+
+    static constexpr size_t npos = LocCodeIndex::npos;
+
+    // neighbours of a cell sharing a face (6), at least an edge (18) or at least a vertex (26)
+    enum class Adjacency { FACE, EDGE, VERTEX };
+
+    // location code -> storage index of all nodes, rebuilt by build_node_index after the tree changes
+    LocCodeIndex node_index;
+
+    void build_node_index() { node_index.assign(storage); }
+
+    // storage index of the node with exactly this location code, npos if there is none
+    size_t find_node(uint64_t loc_code) const { return node_index.find(loc_code); }
+
+    // storage index of the node covering the cell loc_code: the node itself, or the leaf above it if the tree is
+    // coarser there. npos if the cell is empty (the deepest existing ancestor is not a leaf). The prefixes of loc_code
+    // that exist form the levels 0..l, so l is found by a binary search: O(log depth) hash lookups.
+    size_t find_cell(uint64_t loc_code) const {
+        size_t index = find_node(loc_code);
+        if (index != npos || storage.empty()) return index;
+        size_t level = tree_depth(loc_code);
+        size_t exists = 0, missing = level;
+        index = 0;
+        while (missing - exists > 1) {
+            size_t middle = (exists + missing) / 2;
+            size_t found = find_node(loc_code >> (3 * (level - middle)));
+            if (found != npos) {
+                exists = middle;
+                index = found;
+            } else {
+                missing = middle;
+            }
+        }
+        return storage[index].config == 0 ? index : npos;
+    }
+
+    // location code of the cell (x, y, z) at level depth, every coordinate in [0, 2^depth)
+    static uint64_t cell_code(size_t depth, uint64_t x, uint64_t y, uint64_t z) {
+        return uint64_t(1) << (3 * depth) | spread_bits(x) | spread_bits(y) << 1 | spread_bits(z) << 2;
+    }
+
+    // cell coordinates of a location code, the inverse of cell_code
+    static void cell_coordinates(uint64_t loc_code, uint64_t &x, uint64_t &y, uint64_t &z) {
+        uint64_t code = loc_code ^ (uint64_t(1) << (3 * tree_depth(loc_code)));
+        x = compact_bits(code);
+        y = compact_bits(code >> 1);
+        z = compact_bits(code >> 2);
+    }
+
+    // location code of the cell at the same level shifted by (dx, dy, dz) cells, 0 (no valid code) outside the root
+    static uint64_t neighbour_code(uint64_t loc_code, int64_t dx, int64_t dy, int64_t dz) {
+        size_t depth = tree_depth(loc_code);
+        uint64_t x, y, z;
+        cell_coordinates(loc_code, x, y, z);
+        // unsigned wrap around turns -1 into a coordinate beyond the last cell
+        x += dx;
+        y += dy;
+        z += dz;
+        uint64_t cells = uint64_t(1) << depth;
+        if (x >= cells || y >= cells || z >= cells) return 0;
+        return cell_code(depth, x, y, z);
+    }
+
+    // storage indices of the nodes covering the neighbour cells of loc_code at its level, each node once (a coarser
+    // leaf can cover several cells); empty cells and cells outside the root are left out. Returns the count.
+    size_t find_neighbours(uint64_t loc_code, Adjacency adjacency, size_t neighbours[26]) const {
+        const int max_shared = adjacency == Adjacency::FACE ? 1 : adjacency == Adjacency::EDGE ? 2 : 3;
+        size_t count = 0;
+        for (int64_t dz = -1; dz <= 1; ++dz) {
+            for (int64_t dy = -1; dy <= 1; ++dy) {
+                for (int64_t dx = -1; dx <= 1; ++dx) {
+                    int offsets = (dx != 0) + (dy != 0) + (dz != 0);
+                    if (offsets == 0 || offsets > max_shared) continue;
+                    uint64_t code = neighbour_code(loc_code, dx, dy, dz);
+                    if (code == 0) continue;
+                    size_t index = find_cell(code);
+                    if (index == npos || std::find(neighbours, neighbours + count, index) != neighbours + count) continue;
+                    neighbours[count++] = index;
+                }
+            }
+        }
+        return count;
     }
 
     //function signature: std::function<bool(size_t index, Node &node, AABB &aabb)>
@@ -335,40 +514,81 @@ struct OctreeBase {
 
     //function signature: std::function<bool(size_t index, Node &node, AABB &aabb)>
     void traverse_dfs(const std::function<bool(size_t, Node &, AABB &)> &function) {
-        traverse_dfs(0, root_aabb, function);
+        if (storage.empty()) return;
+        stack_item_t stack[max_stack_size];
+        size_t stack_size = 0;
+        stack[stack_size++] = {0, root_aabb};
+        while (stack_size > 0) {
+            --stack_size;
+            size_t index = stack[stack_size].first;
+            AABB aabb = stack[stack_size].second;
+            if (!function(index, storage[index], aabb)) continue;
+            push_children(storage[index], aabb, stack, stack_size);
+        }
     }
 
     //function signature: std::function<bool(size_t index, const Node &node, const AABB &aabb)>
     void traverse_dfs(const std::function<bool(size_t, const Node &, const AABB &)> &function) const {
-        traverse_dfs(0, root_aabb, function);
+        if (storage.empty()) return;
+        stack_item_t stack[max_stack_size];
+        size_t stack_size = 0;
+        stack[stack_size++] = {0, root_aabb};
+        while (stack_size > 0) {
+            --stack_size;
+            const size_t index = stack[stack_size].first;
+            const AABB aabb = stack[stack_size].second;
+            if (!function(index, storage[index], aabb)) continue;
+            push_children(storage[index], aabb, stack, stack_size);
+        }
     }
 
 protected:
+    // location codes have 3 bits per level below the root bit, so 21 levels fit into 64 bits
+    static constexpr size_t max_depth = 21;
+    // depth first traversals keep at most 7 pending siblings per level plus the children of the deepest node on
+    // their stack
+    static constexpr size_t max_stack_size = 8 * (max_depth + 1);
+    using stack_item_t = std::pair<size_t, AABB>;
+
+    static size_t child_count(uint8_t config) {
+        size_t count = 0;
+        for (uint8_t i = 0; i < 8; ++i) count += CHECK_BIT(config, i);
+        return count;
+    }
 
-    //function signature: std::function<bool(size_t index, Node &node, AABB &aabb)>
-    void traverse_dfs(size_t index, AABB &aabb, const std::function<bool(size_t, Node &, AABB &)> &function) {
-        if (!function(index, storage[index], aabb)) return;
-
+    // pushes the children of node in reverse octant order, so they are popped (visited) in octant order
+    static void push_children(const Node &node, const AABB &aabb, stack_item_t *stack, size_t &stack_size) {
         Vec3 child_extent = aabb.halfsize / 2;
-        size_t offset = 0;
-        for (uint8_t i = 0; i < 8; ++i) {
-            if (!child_exists(storage[index].config, i)) continue;
-            traverse_dfs(storage[index].first_child_index + offset, child_box(aabb, i, child_extent), function); // WHYYYYYY??? Please! Never! Never ever use recursion in production code!
-            ++offset;
+        size_t offset = child_count(node.config);
+        for (int i = 7; i >= 0; --i) {
+            if (!child_exists(node.config, static_cast<uint8_t>(i))) continue;
+            --offset;
+            stack[stack_size++] = {node.first_child_index + offset, child_box(aabb, static_cast<uint8_t>(i), child_extent)};
         }
     }
 
-    //function signature: std::function<bool(size_t index, const Node &node, const AABB &aabb)>
-    void traverse_dfs(size_t index, const AABB &aabb,
-                      const std::function<bool(size_t, const Node &, const AABB &)> &function) const {
-        if (!function(index, storage[index], aabb)) return;
-
-        Vec3 child_extent = aabb.halfsize / 2;
-        size_t offset = 0;
+    // squared distances from point to the closest and the farthest point of each of the 8 child boxes of aabb.
+    // Along every axis a child is either the lower or the upper half, so there are two values per axis which are
+    // combined without branches; the loop over the octants vectorises.
+    static void child_box_distances(const AABB &aabb, const Vec3 &point, float min_squared[8], float max_squared[8]) {
+        float axis_min[3][2], axis_max[3][2];
+        for (size_t a = 0; a < 3; ++a) {
+            float below = point[a] - (aabb.center[a] - aabb.halfsize[a]);
+            float middle = point[a] - aabb.center[a];
+            float above = point[a] - (aabb.center[a] + aabb.halfsize[a]);
+            // lower half [center - halfsize, center], upper half [center, center + halfsize]
+            float lower = std::max(std::max(-below, middle), 0.0f);
+            float upper = std::max(std::max(-middle, above), 0.0f);
+            axis_min[a][0] = lower * lower;
+            axis_min[a][1] = upper * upper;
+            lower = std::max(std::abs(below), std::abs(middle));
+            upper = std::max(std::abs(middle), std::abs(above));
+            axis_max[a][0] = lower * lower;
+            axis_max[a][1] = upper * upper;
+        }
         for (uint8_t i = 0; i < 8; ++i) {
-            if (!child_exists(storage[index].config, i)) continue;
-            traverse_dfs(storage[index].first_child_index + offset, child_box(aabb, i, child_extent), function);
-            ++offset;
+            min_squared[i] = axis_min[0][i & 1] + axis_min[1][(i >> 1) & 1] + axis_min[2][(i >> 2) & 1];
+            max_squared[i] = axis_max[0][i & 1] + axis_max[1][(i >> 1) & 1] + axis_max[2][(i >> 2) & 1];
         }
     }
 
@@ -436,6 +656,49 @@ protected:
     static size_t tree_depth(uint64_t loc_code) {
         return (63 - clz(loc_code)) / 3;
     }
+
+    // moves the low 21 bits of v to every third bit (bit i to bit 3 i)
+    static uint64_t spread_bits(uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // inverse of spread_bits, collects every third bit starting at bit 0
+    static uint64_t compact_bits(uint64_t v) {
+        v &= 0x1249249249249249ull;
+        v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ull;
+        v = (v ^ (v >> 4)) & 0x100f00f00f00f00full;
+        v = (v ^ (v >> 8)) & 0x1f0000ff0000ffull;
+        v = (v ^ (v >> 16)) & 0x1f00000000ffffull;
+        v = (v ^ (v >> 32)) & 0x1fffff;
+        return v;
+    }
+
+    // storage is in BFS order, children always come after their parent: walking it backwards visits every child
+    // before its parent, so one pass merges the leaf values all the way up to the root
+    template<class Aggregate>
+    void merge_bottom_up(std::vector<Aggregate> &aggregates) const {
+        for (size_t i = storage.size(); i-- > 1;) {
+            aggregates[storage[i].parent_index].merge(aggregates[i]);
+        }
+    }
+
+    // squared distances from point to the closest and the farthest point of the box
+    static void box_distances(const AABB &aabb, const Vec3 &point, float &min_squared, float &max_squared) {
+        Vec3 d = (point - aabb.center).cwise_abs();
+        Vec3 d_min = d - aabb.halfsize;
+        Vec3 d_max = d + aabb.halfsize;
+        min_squared = 0;
+        for (size_t i = 0; i < 3; ++i) {
+            if (d_min[i] > 0) min_squared += d_min[i] * d_min[i];
+        }
+        max_squared = d_max.squared_length();
+    }
 };
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -446,6 +709,41 @@ struct OctantIndices {
     size_t start, end, size, idx;
 };
 
+// count, coordinate sum, attribute sum and attribute weighted coordinate sum of the points below a node,
+// accumulated in double
+struct PointAggregate {
+    size_t count = 0;
+    double position_sum[3] = {0, 0, 0};
+    double attribute_sum = 0;
+    double attribute_moment[3] = {0, 0, 0};
+
+    void add(const Vec3 &point, double attribute) {
+        ++count;
+        for (size_t i = 0; i < 3; ++i) position_sum[i] += point[i];
+        attribute_sum += attribute;
+        for (size_t i = 0; i < 3; ++i) attribute_moment[i] += attribute * point[i];
+    }
+
+    void merge(const PointAggregate &other) {
+        count += other.count;
+        for (size_t i = 0; i < 3; ++i) position_sum[i] += other.position_sum[i];
+        attribute_sum += other.attribute_sum;
+        for (size_t i = 0; i < 3; ++i) attribute_moment[i] += other.attribute_moment[i];
+    }
+
+    Vec3 centroid() const {
+        if (count == 0) return Vec3::Zero();
+        return Vec3(static_cast<float>(position_sum[0] / count), static_cast<float>(position_sum[1] / count),
+                    static_cast<float>(position_sum[2] / count));
+    }
+};
+
+// sum_i w_i * a_i and sum_i w_i of a gaussian weighted neighbourhood
+struct GaussianSum {
+    double weighted_sum = 0;
+    double weight = 0;
+};
+
 struct Octree : public OctreeBase<OctantIndices> {
     const std::vector<Vec3> &points;
     size_t leaf_size;
@@ -458,23 +756,340 @@ struct Octree : public OctreeBase<OctantIndices> {
 
     void clear() override;
 
-    void build(size_t leaf_size = 1);
+    // splits nodes with more than leaf_size points, see create_sorted, and fills node_index; num_threads = 0 uses
+    // all cores
+    void build(size_t leaf_size = 1, size_t num_threads = 0);
+
+    // the same tree built top-down on one thread, only the order of the indices within a leaf differs
+    void build_bfs(size_t leaf_size = 1);
 
     ResultSet query_radius(const Vec3 &point, float radius, size_t depth = 21) const;
 
+    // pairs of point index and squared distance in a caller owned buffer, which is cleared first; returns the count
+    size_t query_radius(const Vec3 &point, float radius, std::vector<std::pair<size_t, float>> &results,
+                        size_t depth = 21) const;
+
+    // calls visitor(size_t point_index, float squared_distance) for every point closer than radius, children
+    // entirely inside the sphere are scanned without further box tests; nothing is allocated
+    template<class Visitor>
+    void visit_radius(const Vec3 &point, float radius, Visitor &&visitor, size_t depth = 21) const {
+        const float squared_radius = radius * radius;
+        visit_radius_nodes(point, radius, depth, [&](const Node &node) {
+            visit_points(node, point, squared_radius, visitor);
+        }, visitor);
+    }
+
     ResultSet query_knn(const Vec3 &point, int k, size_t depth = 21) const;
 
+    // knn query into a caller owned result set, which is reset first
+    void query_knn(const Vec3 &point, int k, ResultSet &resultSet, size_t depth = 21) const;
+
+    // per-node aggregates indexed like storage, add_point(Aggregate &, size_t point_index) is called for the points
+    // of every leaf, Aggregate::merge then combines the children bottom-up in a single pass
+    template<class Aggregate, class AddPoint>
+    std::vector<Aggregate> aggregate(AddPoint add_point) const {
+        std::vector<Aggregate> aggregates(storage.size());
+        for (size_t i = 0; i < storage.size(); ++i) {
+            const Node &node = storage[i];
+            if (node.config != 0) continue;
+            for (size_t j = node.data.start; j < node.data.start + node.data.size; ++j) {
+                add_point(aggregates[i], indices[j]);
+            }
+        }
+        merge_bottom_up(aggregates);
+        return aggregates;
+    }
+
+    // count, centroid and sum of attributes[point index] per node; attributes may be empty (sum stays 0)
+    std::vector<PointAggregate> aggregate_points(const std::vector<double> &attributes) const;
+
+    // gaussian weighted sum (sdev sigma) of the attributes of all points closer than radius to point. A node
+    // inside the sphere whose squared half diagonal is below tolerance * sigma^2 is taken as a whole: expanded
+    // around its centroid the first order terms vanish (weight sum) or come from the attribute moment (attribute
+    // sum), the error left is second order in half diagonal / sigma.
+    GaussianSum gaussian_sum(const std::vector<PointAggregate> &aggregates, const std::vector<double> &attributes,
+                             const Vec3 &point, float sigma, float radius, double tolerance) const;
+
+    // gaussian_sum for num_scales (at most 32) sigma / radius pairs in a single traversal, a node is only opened
+    // while some scale still needs it
+    void gaussian_sums(const std::vector<PointAggregate> &aggregates, const std::vector<double> &attributes,
+                       const Vec3 &point, const float *sigmas, const float *radii, size_t num_scales,
+                       double tolerance, GaussianSum *sums) const;
+
+    // number of points closer than radius, nodes inside the sphere are counted without visiting their points
+    size_t count_radius(const Vec3 &point, float radius) const;
+
+    // location code of the cell at level depth containing point, by the same box arithmetic as the build; a point
+    // outside the root box falls into the boundary cell closest to it, along an axis on which the root box has no
+    // extent (planar clouds, coincident points) into cell 0 like all points of the tree
+    uint64_t locate(const Vec3 &point, size_t depth = 21) const;
+
 protected:
-    void init(size_t leaf_size);
+    void init(size_t leaf_size, size_t num_threads);
 
     virtual void create_bfs();
 
-    virtual void
-    query_radius(size_t index, const AABB &aabb, const Vec3 &point, float radius, ResultSet &resultSet,
-                 size_t depth) const;
+    // sorts the points by their 63 bit location code below the root (parallel code computation and radix sort), the
+    // points of a node then form a contiguous run of equal code prefixes and the nodes are emitted in BFS order from
+    // these runs. indices ends up in Morton order, which keeps the points of neighbouring nodes close in memory.
+    void create_sorted(size_t num_threads);
+
+    static constexpr size_t code_block_size = 8;
+
+    // octants on all max_depth levels (the first level in the highest bits) of the count <= code_block_size points
+    // in block; the bits of an axis on which the root box has no extent are 0
+    void point_codes(const Vec3 *block, size_t count, uint64_t *codes) const;
+
+    // inside_node(const Node &) for every node entirely inside the sphere (its points are not visited),
+    // visitor(size_t point_index, float squared_distance) for the points closer than radius in the leaves crossing it
+    template<class InsideNode, class Visitor>
+    void visit_radius_nodes(const Vec3 &point, float radius, size_t depth, InsideNode &&inside_node,
+                            Visitor &&visitor) const {
+        if (storage.empty()) return;
+        const float squared_radius = radius * radius;
+        stack_item_t stack[max_stack_size];
+        size_t stack_size = 0;
+        stack[stack_size++] = {0, root_aabb};
+        while (stack_size > 0) {
+            --stack_size;
+            const Node &node = storage[stack[stack_size].first];
+            const AABB aabb = stack[stack_size].second;
+            if (node.config == 0 || tree_depth(node.loc_code) >= depth) {
+                visit_points(node, point, squared_radius, visitor);
+                continue;
+            }
+
+            float min_squared[8], max_squared[8];
+            child_box_distances(aabb, point, min_squared, max_squared);
+            Vec3 child_extent = aabb.halfsize / 2;
+            size_t child = node.first_child_index;
+            for (uint8_t i = 0; i < 8; ++i) {
+                if (!child_exists(node.config, i)) continue;
+                if (max_squared[i] < squared_radius) {
+                    inside_node(storage[child]);
+                } else if (min_squared[i] < squared_radius) {
+                    stack[stack_size++] = {child, child_box(aabb, i, child_extent)};
+                }
+                ++child;
+            }
+        }
+    }
+
+    template<class Visitor>
+    void visit_points(const Node &node, const Vec3 &point, float squared_radius, Visitor &visitor) const {
+        for (size_t i = node.data.start; i < node.data.start + node.data.size; ++i) {
+            size_t idx = indices[i];
+            float squared_dist = (points[idx] - point).squared_length();
+            if (squared_dist < squared_radius) visitor(idx, squared_dist);
+        }
+    }
+
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// ids of the points in a DynamicOctree leaf (in no particular order) and the number of points below a node
+struct PointBucket {
+    std::vector<size_t> ids;
+    size_t count = 0;
+};
+
+// octree over points it owns, updated in place instead of rebuilt: insert appends points and returns their ids,
+// remove and move / transform update single points. Ids stay valid until clear or assign, removed ids are not
+// reused. A leaf is split once it holds more than leaf_size points, an inner node is merged back into a leaf once its
+// subtree holds at most leaf_size / 2, so updates around one size do not split and merge over and over.
+//
+// Inner nodes always have all 8 children (empty ones are leaves without points), so the children of a node are
+// storage[first_child_index + octant]; freed blocks of 8 are reused. The root is a cube with a power of two halfsize
+// centered on a multiple of it: all child boxes are exact in float (down to the depth the coordinates resolve), and
+// a point outside the root doubles it with the old root as one of the children. Rebalancing is amortised: once
+// there were more updates than points since the last rebuild, the tree is rebuilt if its root has become at least
+// four times wider than the points need.
+struct DynamicOctree : protected OctreeBase<PointBucket> {
+    using OctreeBase::Node;
+    using OctreeBase::container_t;
+    using OctreeBase::ResultSet;
+    using OctreeBase::npos;
+    using OctreeBase::Adjacency;
+    using OctreeBase::traverse_dfs;
+    using OctreeBase::cell_code;
+    using OctreeBase::cell_coordinates;
+    using OctreeBase::neighbour_code;
+    // the location code index is not kept up to date by the updates (they clear it), call build_node_index after a
+    // batch of updates before using the lookups
+    using OctreeBase::build_node_index;
+    using OctreeBase::find_node;
+    using OctreeBase::find_cell;
+    using OctreeBase::find_neighbours;
+
+    explicit DynamicOctree(size_t leaf_size = 16) : leaf_size(leaf_size > 0 ? leaf_size : 1), num_points(0),
+                                                    updates(0) {}
+
+    ~DynamicOctree() override = default;
+
+    void clear() override;
+
+    // replaces the contents by points, the id of points[i] is i; built top-down
+    void assign(const std::vector<Vec3> &points);
+
+    // id of the new point; insert, assign, move and transform throw std::invalid_argument for a non finite point
+    size_t insert(const Vec3 &point);
+
+    // inserts a batch (a scan patch), the root grows at most once for the whole batch. The ids are consecutive,
+    // returns the first one.
+    size_t insert(const std::vector<Vec3> &points);
+
+    // false if id was removed already
+    bool remove(size_t id);
+
+    // new position of a point (ignored for a removed id): updated in place if it stays in its leaf, otherwise moved to its new leaf
+    void move(size_t id, const Vec3 &point);
+
+    // point = transform(point) for the points ids (e.g. a rigid transform of a scan patch in a registration loop),
+    // removed ids are skipped; the rebalancing check runs once for the whole batch
+    template<class Transform>
+    void transform(const std::vector<size_t> &ids, Transform &&transform) {
+        for (size_t id : ids) {
+            if (!contains(id)) continue;
+            const Vec3 point = transform(positions[id]);
+            check_finite(point);
+            relocate(id, point);
+        }
+        rebalance_if_due();
+    }
+
+    // rebuilds the tree around the current points, the ids are kept
+    void rebuild();
+
+    bool contains(size_t id) const { return id < locations.size() && locations[id].leaf != npos; }
+
+    const Vec3 &point(size_t id) const { return positions[id]; }
+
+    // positions by id, including the stale positions of removed ids
+    const std::vector<Vec3> &points() const { return positions; }
+
+    // number of points in the tree
+    size_t size() const { return num_points; }
+
+    // number of ids handed out, removed ones included
+    size_t num_ids() const { return positions.size(); }
+
+    const AABB &root_box() const { return root_aabb; }
+
+    // storage index of the root is 0; freed nodes stay in storage (location code 0) until their block is reused
+    const container_t &nodes() const { return storage; }
+
+    // calls visitor(size_t id, float squared_distance) for every point closer than radius
+    template<class Visitor>
+    void visit_radius(const Vec3 &point, float radius, Visitor &&visitor) const {
+        if (storage.empty()) return;
+        const float squared_radius = radius * radius;
+        stack_item_t stack[max_stack_size];
+        size_t stack_size = 0;
+        stack[stack_size++] = {0, root_aabb};
+        while (stack_size > 0) {
+            --stack_size;
+            const Node &node = storage[stack[stack_size].first];
+            const AABB aabb = stack[stack_size].second;
+            if (node.config == 0) {
+                for (size_t id : node.data.ids) {
+                    float squared_dist = (positions[id] - point).squared_length();
+                    if (squared_dist < squared_radius) visitor(id, squared_dist);
+                }
+                continue;
+            }
+
+            float min_squared[8], max_squared[8];
+            child_box_distances(aabb, point, min_squared, max_squared);
+            Vec3 child_extent = aabb.halfsize / 2;
+            for (uint8_t i = 0; i < 8; ++i) {
+                size_t child = node.first_child_index + i;
+                if (min_squared[i] < squared_radius && storage[child].data.count > 0) {
+                    stack[stack_size++] = {child, child_box(aabb, i, child_extent)};
+                }
+            }
+        }
+    }
+
+    // pairs of id and squared distance in a caller owned buffer, which is cleared first; returns the count
+    size_t query_radius(const Vec3 &point, float radius, std::vector<std::pair<size_t, float>> &results) const;
+
+    // best-first knn query into a caller owned result set, which is reset first; the distances are not squared
+    void query_knn(const Vec3 &point, int k, ResultSet &resultSet) const;
+
+protected:
+    // leaf and position in its ids of a point, leaf is npos once the point is removed
+    struct PointLocation {
+        size_t leaf, slot;
+    };
+
+    std::vector<Vec3> positions;
+    std::vector<PointLocation> locations;
+    // first storage index of every freed block of 8 nodes
+    std::vector<size_t> free_blocks;
+    size_t leaf_size;
+    size_t num_points;
+    // inserts, removes and moves to another leaf since the last rebuild
+    size_t updates;
+
+    // updates below this count never trigger the rebalancing check, it costs a pass over the points
+    static constexpr size_t min_rebalance_updates = 1024;
+
+    // smallest cube with a power of two halfsize, centered on a multiple of it, that contains [min, max]
+    static AABB dyadic_cube(const Vec3 &min, const Vec3 &max);
+
+    static bool inside(const AABB &aabb, const Vec3 &point) {
+        for (size_t a = 0; a < 3; ++a) {
+            if (!(point[a] >= aabb.center[a] - aabb.halfsize[a] && point[a] <= aabb.center[a] + aabb.halfsize[a])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // tree over the points ids below a single root fitted to them
+    void build_from(const std::vector<size_t> &ids);
+
+    // throws std::invalid_argument, a non finite point would grow the root forever
+    static void check_finite(const Vec3 &point);
+
+    // moves a contained point, point has to be finite
+    void relocate(size_t id, const Vec3 &point);
+
+    // inserts the point of id (positions[id] is set) into its leaf, growing the root and splitting as needed
+    void attach(size_t id);
+
+    // takes id out of its leaf and merges the highest ancestor left with at most leaf_size / 2 points
+    void detach(size_t id);
+
+    // leaf containing point (which has to be inside the root) and its box
+    size_t find_leaf(const Vec3 &point, AABB &aabb) const;
+
+    void put(size_t leaf, size_t id) {
+        PointBucket &bucket = storage[leaf].data;
+        locations[id] = {leaf, bucket.ids.size()};
+        bucket.ids.push_back(id);
+        ++bucket.count;
+    }
+
+    // first index of a block of 8 empty leaves below parent, the parent itself is not changed
+    size_t allocate_children(size_t parent);
+
+    void free_children(size_t first);
+
+    // splits leaf and its new children while they hold more than leaf_size points
+    void split(size_t leaf, const AABB &aabb);
+
+    // turns the inner node index into a leaf holding all points of its subtree
+    void collapse(size_t index);
+
+    // doubles the root until it contains point
+    void grow_root(const Vec3 &point);
 
-    virtual void query_knn(size_t index, const AABB &aabb, const Vec3 &point, ResultSet &resultSet, size_t depth) const;
+    // location codes from the root down after the root grew, inner nodes that reach max_depth are collapsed
+    void refresh_loc_codes();
 
+    void rebalance_if_due();
 };
 
 //}
@@ -0,0 +1,83 @@
+#ifndef _COTAN_LAPLACIAN_H_
+#define _COTAN_LAPLACIAN_H_
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <vector>
+#include <cstddef>
+#include <point_matrix.h>
+#include <parallel.h>
+
+// cotangent Laplacian L and Voronoi vertex areas (the diagonal of the mass matrix) of a triangle mesh, the same
+// values as igl::cotmatrix and igl::massmatrix(MASSMATRIX_TYPE_VORONOI). The sparsity pattern of L and, for every
+// value slot, the half-edges summed into it are set up once from the faces; assemble() computes the per-half-edge
+// weights in parallel over faces and gathers them into the value arrays, so re-assembling for moved vertices
+// (smoothing flows) sorts no triplets and allocates nothing. MeshT caches one per mesh (cotan_laplacian()).
+class CotanLaplacian
+{
+public:
+	CotanLaplacian(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, std::size_t num_threads = 0);
+
+	// values of L, of the vertex areas and of the half-edge weights for the vertex positions
+	void assemble(const points_t& vertices);
+
+	const Eigen::SparseMatrix<double>& laplacian() const { return m_laplacian; }
+	const Eigen::VectorXd& masses() const { return m_masses; }
+	// half the cotangent of the angle opposite to half-edge h = 3 * f + k (see HalfEdgeView), L(i, j) is the sum
+	// over the (one or two) half-edges between i and j
+	const std::vector<double>& halfEdgeWeights() const { return m_half_edge_weights; }
+
+	// A = mass_factor * M + laplacian_factor * L; A keeps the pattern of L (it is set up on the first call), so
+	// a solver can analyse the pattern once and only factorize again after the next assemble()
+	void combine(double mass_factor, double laplacian_factor, Eigen::SparseMatrix<double>& A) const;
+
+	// A(i, j) = edge_weight(i, j) * L(i, j) off the diagonal and the diagonal making every column sum to zero;
+	// edge_weight has to be symmetric so A stays symmetric. A keeps the pattern of L as in combine()
+	template <typename EdgeWeight>
+	void weightedLaplacian(EdgeWeight edge_weight, Eigen::SparseMatrix<double>& A) const;
+private:
+	void setupPattern(Eigen::SparseMatrix<double>& A) const;
+
+	Eigen::MatrixXi m_faces;
+	std::size_t m_num_threads;
+	Eigen::SparseMatrix<double> m_laplacian;
+	Eigen::VectorXd m_masses;
+	std::vector<double> m_half_edge_weights;
+	// Voronoi area of corner k of face f at 3 * f + k
+	std::vector<double> m_corner_areas;
+	// half-edges (both directions) summed into value slot n: slot_half_edges[slot_offsets[n], slot_offsets[n + 1]),
+	// empty for the diagonal
+	std::vector<int> m_slot_offsets;
+	std::vector<int> m_slot_half_edges;
+	// corners of vertex v: vertex_corners[vertex_offsets[v], vertex_offsets[v + 1])
+	std::vector<int> m_vertex_offsets;
+	std::vector<int> m_vertex_corners;
+	// slot of L(v, v)
+	std::vector<int> m_diagonal_slots;
+};
+
+template <typename EdgeWeight>
+void CotanLaplacian::weightedLaplacian(EdgeWeight edge_weight, Eigen::SparseMatrix<double>& A) const
+{
+	setupPattern(A);
+	const int* outer = m_laplacian.outerIndexPtr();
+	const int* inner = m_laplacian.innerIndexPtr();
+	const double* values = m_laplacian.valuePtr();
+	double* result = A.valuePtr();
+	// every column writes only its own slots
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(Parallel::numThreads(m_num_threads))
+	for (Eigen::Index col = 0; col < m_laplacian.outerSize(); ++col)
+	{
+		const int diagonal = m_diagonal_slots[static_cast<std::size_t>(col)];
+		double sum = 0.0;
+		for (int n = outer[col]; n < outer[col + 1]; ++n)
+		{
+			if (n == diagonal)
+				continue;
+			result[n] = edge_weight(inner[n], static_cast<int>(col)) * values[n];
+			sum += result[n];
+		}
+		result[diagonal] = -sum;
+	}
+}
+
+#endif
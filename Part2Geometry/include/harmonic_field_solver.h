@@ -0,0 +1,72 @@
+#ifndef _HARMONIC_FIELD_SOLVER_H_
+#define _HARMONIC_FIELD_SOLVER_H_
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <vector>
+#include <memory>
+#include <cotan_laplacian.h>
+#include <mesh_multigrid.h>
+
+// harmonic fields of a weighted cotangent Laplacian K = -weightedLaplacian(edge_weight): K u = 0 on the free vertices,
+// u given on the constrained ones. Eliminating the constrained vertices leaves the symmetric positive definite system
+// K_FF u_F = -K_FC u_C (every connected component needs a constrained vertex), factorized by a simplicial LDLT with a
+// fill-reducing (AMD) ordering. The ordering and the symbolic factorization only depend on the mesh and the
+// constrained vertices and are computed in the constructor; factorize() with new edge weights (parameter sweeps)
+// refills the values and redoes the numeric factorization only, and one factorization solves any number of fields.
+// The fill of the factors grows faster than the mesh, so large meshes are solved by conjugate gradients preconditioned
+// with a MeshMultigrid hierarchy instead (linear time and memory, rebuilt by factorize()). Every further field costs
+// a full CG solve there but only two triangular solves with the factors, so the choice depends on both.
+class HarmonicFieldSolver
+{
+public:
+	enum class Method
+	{
+		// MULTIGRID from multigrid_threshold free vertices per field on, DIRECT below
+		AUTOMATIC,
+		// simplicial LDLT
+		DIRECT,
+		// multigrid preconditioned conjugate gradients
+		MULTIGRID
+	};
+	static constexpr Eigen::Index multigrid_threshold = 100000;
+	// relative residual of the MULTIGRID solves
+	static constexpr double tolerance = 1e-8;
+
+	// the solver co-owns the operators, so they stay valid when the mesh drops or rebuilds its own; constrained
+	// vertices are taken once each; num_fields is the number of fields solve() gets per factorization (AUTOMATIC)
+	HarmonicFieldSolver(std::shared_ptr<const CotanLaplacian> operators, const std::vector<int>& constrained, Method method = Method::AUTOMATIC, std::size_t num_fields = 1);
+
+	template <typename EdgeWeight>
+	void factorize(EdgeWeight edge_weight)
+	{
+		m_operators->weightedLaplacian(edge_weight, m_weighted);
+		refactorize();
+	}
+
+	// boundary_values(c, k) is the value of field k at constrained()[c], returns the fields as columns
+	Eigen::MatrixXd solve(const Eigen::MatrixXd& boundary_values) const;
+
+	const std::shared_ptr<const CotanLaplacian>& operators() const { return m_operators; }
+	const std::vector<int>& constrained() const { return m_constrained; }
+	Eigen::Index numFree() const { return static_cast<Eigen::Index>(m_free.size()); }
+	// DIRECT or MULTIGRID
+	Method method() const { return m_method; }
+private:
+	void refactorize();
+
+	std::shared_ptr<const CotanLaplacian> m_operators;
+	Method m_method;
+	std::vector<int> m_constrained;
+	std::vector<int> m_free;
+	// weighted Laplacian with the pattern of L
+	Eigen::SparseMatrix<double> m_weighted;
+	// K_FF and K_FC, value n is taken from slot *_slots[n] of m_weighted
+	Eigen::SparseMatrix<double> m_free_block;
+	Eigen::SparseMatrix<double> m_coupling_block;
+	std::vector<int> m_free_slots;
+	std::vector<int> m_coupling_slots;
+	Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower, Eigen::AMDOrdering<int>> m_solver;
+	Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper, MeshMultigrid> m_iterative_solver;
+};
+
+#endif
@@ -4,6 +4,17 @@
 #include <memory>
 #include <Eigen/Dense>
 #include <limits>
+#include <point_matrix.h>
+
+enum class ICPSolverType
+{
+	// classic SVD fit of the corresponding point pairs
+	POINT_TO_POINT,
+	// linearized least squares on the distances to the target tangent planes
+	POINT_TO_PLANE,
+	// linearized least squares on the sum of both normals (Rusinkiewicz 2019)
+	SYMMETRIC_POINT_TO_PLANE
+};
 
 struct ICPParams
 {
@@ -12,50 +23,190 @@ struct ICPParams
 	double min_err = 1e-5;
 	double min_err_change = 1e-8;
 	std::size_t max_iterations = 200;
+	// threads used for the correspondence search, 0 uses all available cores
+	std::size_t num_threads = 0;
+	ICPSolverType solver_type = ICPSolverType::POINT_TO_POINT;
+	// coarse-to-fine alignment on voxel-downsampled copies of the sets, 1 disables the pyramid
+	std::size_t pyramid_levels = 1;
+	// voxel size of the finest coarse level (doubled per level), 0 derives it from the target extent and size
+	double pyramid_voxel_size = 0.0;
+	// max_distance is used on the full resolution sets and divided by this factor on every coarser level
+	double pyramid_max_distance_scale = 0.5;
+	// skip the kd-tree query for points that provably kept their nearest neighbour since the last query
+	bool reuse_correspondences = true;
+	// number of previous iterates combined by Anderson acceleration, 0 runs plain ICP
+	std::size_t anderson_depth = 0;
+	// progress output on std::cout, switch it off when several alignments run concurrently
+	bool verbose = true;
+};
+
+// buffers of one align() call, sized once and reused by every iteration; positions are kept in the scalar
+// type of the point sets, distances and the pair statistics in double
+template <typename Scalar>
+struct ICPWorkspace
+{
+	// per query point: nearest target point, its distance and whether the pair passed the rejection tests
+	Eigen::VectorXi nearest;
+	Eigen::VectorXd nearest_distance;
+	Eigen::Matrix<bool, Eigen::Dynamic, 1> accepted;
+	// per query point: position, nearest and second nearest distance at its last kd-tree query
+	PointMatrix<Scalar> anchor_points;
+	Eigen::VectorXd anchor_nearest_distance;
+	Eigen::VectorXd anchor_second_distance;
+	bool has_cached_neighbours = false;
+	Eigen::DenseIndex num_skipped_queries = 0;
+	// accepted (query, target) pairs, only the first num_correspondences rows are valid
+	Eigen::MatrixXi correspondences;
+	Eigen::DenseIndex num_correspondences = 0;
+	// statistics of the valid pairs, filled in one streaming pass
+	Eigen::Vector3d query_mean;
+	Eigen::Vector3d target_mean;
+	Eigen::Matrix3d cross_covariance;
+	double error = 0.0;
+	// query set as it was at the start of the level, accelerated iterates are applied to it directly
+	PointMatrix<Scalar> source_points;
+	PointMatrix<Scalar> source_normals;
+
+	void reserve(Eigen::DenseIndex num_query_points);
 };
 
-class ICPAligner
+// Anderson acceleration of the fixed point iteration x_k+1 = G(x_k) that one ICP step performs on the
+// accumulated transform x = (rotation vector, translation); the history lives in fixed size buffers
+class ICPAndersonAccelerator
 {
-	using kdtree_t = nanoflann::KDTreeEigenMatrixAdaptor<Eigen::MatrixXd, 3, nanoflann::metric_L2>;
 public:
-	ICPAligner(const Eigen::MatrixXd& target_points);
+	static constexpr int max_depth = 16;
+	using vec6_t = Eigen::Matrix<double, 6, 1>;
+
+	void init(std::size_t depth);
+	void reset();
+	// next iterate from the current one and its plain ICP update, g itself while the history is empty
+	vec6_t compute(const vec6_t& x, const vec6_t& g, bool& accelerated);
+private:
+	using history_t = Eigen::Matrix<double, 6, Eigen::Dynamic, Eigen::ColMajor, 6, max_depth>;
+	history_t m_delta_g;
+	history_t m_delta_f;
+	vec6_t m_prev_g;
+	vec6_t m_prev_f;
+	int m_depth = 0;
+	int m_count = 0;
+	int m_next = 0;
+	bool m_has_prev = false;
+};
+
+// point sets in Scalar (double or float, the latter with a float kd-tree); poses, errors and the normal
+// equations are always accumulated in double
+template <typename Scalar>
+class ICPAlignerT
+{
+	// fixed column count: nanoflann then keeps its per-query distance buffer on the stack
+	using kdtree_t = PointKdTree<Scalar>;
+	using workspace_type = ICPWorkspace<Scalar>;
+public:
+	using points_type = PointMatrix<Scalar>;
+
+	ICPAlignerT(const points_type& target_points);
 
 	double align(Eigen::Matrix3d& optimal_rotation,
 		Eigen::Vector3d& optimal_translation,
-		Eigen::MatrixXd& query_points,
-		const Eigen::MatrixXd & target_points,
-		const Eigen::MatrixXd& target_normals,
-		const Eigen::MatrixXd& query_normals,
+		points_type& query_points,
+		const points_type & target_points,
+		const points_type& target_normals,
+		const points_type& query_normals,
 		double max_distance = std::numeric_limits<double>::max(),
 		double min_normal_cos_theta = -1.0,
 		double min_err = 1e-5,
 		double min_err_change = 1e-8,
-		size_t max_iterations = 200);
+		size_t max_iterations = 200,
+		std::size_t num_threads = 0,
+		ICPSolverType solver_type = ICPSolverType::POINT_TO_POINT,
+		bool reuse_correspondences = true,
+		std::size_t anderson_depth = 0);
+	double align(Eigen::Matrix3d& optimal_rotation,
+		Eigen::Vector3d& optimal_translation,
+		points_type& query_points,
+		const points_type & target_points,
+		const points_type& target_normals,
+		const points_type& query_normals,
+		const ICPParams& params);
+	// shim for column-major callers: converts to the row-major layout, aligns and writes query_points back
 	double align(Eigen::Matrix3d& optimal_rotation,
 		Eigen::Vector3d& optimal_translation,
 		Eigen::MatrixXd& query_points,
-		const Eigen::MatrixXd & target_points,
+		const Eigen::MatrixXd& target_points,
 		const Eigen::MatrixXd& target_normals,
 		const Eigen::MatrixXd& query_normals,
-		const ICPParams& params);		
-	void setTargetPoints(const Eigen::MatrixXd& target_points);
-	static void applyRigidTransform(Eigen::MatrixXd& points, const Eigen::Matrix3d& optimal_rotation, const Eigen::Vector3d& optimal_translation, bool reorthonormalize_rotation = false);
+		const ICPParams& params);
+	void setTargetPoints(const points_type& target_points);
+	// iterations run by the last align() call, summed over all pyramid levels
+	std::size_t numIterations() const { return m_num_iterations; }
+	// whether the last align() call reached the error thresholds before max_iterations
+	bool converged() const { return m_converged; }
+	static void applyRigidTransform(points_type& points, const Eigen::Matrix3d& optimal_rotation, const Eigen::Vector3d& optimal_translation, bool reorthonormalize_rotation = false, std::size_t num_threads = 0);
+	static void applyRigidTransform(Eigen::MatrixXd& points, const Eigen::Matrix3d& optimal_rotation, const Eigen::Vector3d& optimal_translation);
+	static void voxelDownsample(const points_type& points, const points_type& normals, double voxel_size, points_type& out_points, points_type& out_normals);
 private:
-	void buildKDTree(const Eigen::MatrixXd& points);
-	double calcMAE(const Eigen::MatrixXd& a, const Eigen::MatrixXd& b);
-	double calcMAE(const Eigen::MatrixXd& a, const Eigen::MatrixXd& b, const Eigen::MatrixXi& correspondences);
+	struct ICPPyramidLevel
+	{
+		points_type target_points;
+		points_type target_normals;
+		points_type query_points;
+		points_type query_normals;
+		std::unique_ptr<kdtree_t> kdtree;
+	};
+
+	double alignLevel(Eigen::Matrix3d& optimal_rotation,
+		Eigen::Vector3d& optimal_translation,
+		points_type& query_points,
+		points_type& query_normals,
+		const points_type& target_points,
+		const points_type& target_normals,
+		const kdtree_t& kdtree,
+		double max_distance,
+		double min_normal_cos_theta,
+		double min_err,
+		double min_err_change,
+		size_t max_iterations,
+		std::size_t num_threads,
+		ICPSolverType solver_type,
+		bool reuse_correspondences,
+		std::size_t anderson_depth);
+	void buildKDTree(const points_type& points);
+	double calcMAE(const points_type& a, const points_type& b);
+	double calcCorrespondenceError(workspace_type& workspace, const points_type& query_points, const points_type& query_normals, const points_type& target_points, const points_type& target_normals, const kdtree_t& kdtree, double max_distance, double min_normal_cos_theta, std::size_t num_threads, bool reuse_correspondences);
+	void calcCorrespondenceStatistics(workspace_type& workspace, const points_type& query_points, const points_type& target_points);
 	void calcWeights(Eigen::VectorXd& weights, const Eigen::MatrixXd& distances);
-	void optimalRigidTransform(const Eigen::MatrixXd& query_points, const Eigen::MatrixXd& target_points, const Eigen::MatrixXi& correspondences, const Eigen::VectorXd& weights, Eigen::Matrix3d& optimal_rotation, Eigen::Vector3d& optimal_translation);
+	void optimalRigidTransform(const workspace_type& workspace, Eigen::Matrix3d& optimal_rotation, Eigen::Vector3d& optimal_translation);
+	void optimalRigidTransformPointToPlane(const workspace_type& workspace, const points_type& query_points, const points_type& target_points, const points_type& query_normals, const points_type& target_normals, bool symmetric, Eigen::Matrix3d& optimal_rotation, Eigen::Vector3d& optimal_translation);
+	static ICPAndersonAccelerator::vec6_t toTwist(const Eigen::Matrix3d& rotation, const Eigen::Vector3d& translation);
+	static void setPose(points_type& query_points, points_type& query_normals, const workspace_type& workspace, const ICPAndersonAccelerator::vec6_t& x, Eigen::Matrix3d& rotation, Eigen::Vector3d& translation, std::size_t num_threads);
+	static void applyRotation(points_type& normals, const Eigen::Matrix3d& rotation, std::size_t num_threads);
 	void genCorrespondences(
-		Eigen::MatrixXi& correspondences,
-		Eigen::MatrixXd& distances,
-		const Eigen::MatrixXd& query_points,
-		const Eigen::MatrixXd& target_points,
-		const Eigen::MatrixXd& target_normals,
-		const Eigen::MatrixXd& query_normals,
+		workspace_type& workspace,
+		const points_type& query_points,
+		const points_type& target_normals,
+		const points_type& query_normals,
+		const kdtree_t& kdtree,
 		double max_distance = std::numeric_limits<double>::max(),
-		double min_normal_cos_theta = -1.0);
-	std::unique_ptr<kdtree_t> m_target_kdtree;
+		double min_normal_cos_theta = -1.0,
+		std::size_t num_threads = 0,
+		bool reuse_correspondences = false);
+	// the kd-tree only references its points, so both live together; copies of the aligner share this
+	// read-only index and can align concurrently
+	struct TargetIndex
+	{
+		points_type points;
+		std::unique_ptr<kdtree_t> kdtree;
+	};
+	std::shared_ptr<const TargetIndex> m_target_index;
+	std::size_t m_num_iterations = 0;
+	bool m_converged = false;
+	// progress output of the running align() call, the overload without ICPParams always logs
+	bool m_verbose = true;
 };
 
+using ICPAligner = ICPAlignerT<double>;
+using ICPAlignerf = ICPAlignerT<float>;
+
+
 #endif
\ No newline at end of file
@@ -1,12 +1,13 @@
 #ifndef _INTEGRAL_INVARIANT_SIGNATURES_H_
 #define _INTEGRAL_INVARIANT_SIGNATURES_H_
+#include <Octree.h>
 namespace MeshSamplers
 {
 	struct IntegralInvariantSignaturesSampler
 	{
 		std::string voxelObj;
 		double voxelScale;
-		Eigen::MatrixXd voxels;
+		points_t voxels;
 		double featureCountScale;
 		bool visualize = false;
 		IntegralInvariantSignaturesSampler(std::string pathToVoxel, double vxlScale, double featCntScale, bool visualizeEnable): voxelObj(pathToVoxel), voxelScale(vxlScale), featureCountScale(featCntScale), visualize(visualizeEnable)
@@ -16,14 +17,14 @@ namespace MeshSamplers
 			this->voxels = fillVoxelMatrix(this->voxels, 256);
 		}
 
-		static Eigen::MatrixXd readVoxelOBJ(std::string path)
+		static points_t readVoxelOBJ(std::string path)
 		{
 			std::ifstream voxelrep(path);
 			std::string buf;
 			size_t n = 0;
 			while (std::getline(voxelrep, buf))
 				n++;
-			Eigen::MatrixXd Vx1(n, 3);
+			points_t Vx1(n, 3);
 			voxelrep.clear();
 			voxelrep.seekg(0, std::ios::beg);
 
@@ -40,7 +41,7 @@ namespace MeshSamplers
 		}
 
 		//Fill surface voxel matrix to make it dense
-		static Eigen::MatrixXd fillVoxelMatrix(const Eigen::MatrixXd& src, int vxlDim)
+		static points_t fillVoxelMatrix(const points_t& src, int vxlDim)
 		{
 			std::unique_ptr<kdtree_t> m_kdtree;
 			m_kdtree.reset(new kdtree_t(3, src));
@@ -85,7 +86,7 @@ namespace MeshSamplers
 				}
 			}
 			std::cout << "num adds: " << cntr << std::endl;
-			Eigen::MatrixXd newm(src.rows()+ additions.size(), 3);
+			points_t newm(src.rows()+ additions.size(), 3);
 			newm << src;
 			for (size_t x = 0; x < additions.size(); ++x)
 			{
@@ -94,13 +95,14 @@ namespace MeshSamplers
 			return newm;
 		}
 
+		template <typename Scalar>
 		void sampleMeshPoints(
-			const Mesh& mesh,
-			Eigen::MatrixXd& sampled_points,
-			Eigen::MatrixXd& sampled_normals
+			const MeshT<Scalar>& mesh,
+			PointMatrix<Scalar>& sampled_points,
+			PointMatrix<Scalar>& sampled_normals
 		)
 		{
-			auto mins = mesh.vertices().colwise().minCoeff();
+			Eigen::RowVector3d mins = mesh.vertices().colwise().minCoeff().template cast<double>();
 
 			auto& Voxels = this->voxels;
 			//Align point cloud wish original mesh
@@ -108,9 +110,13 @@ namespace MeshSamplers
 			Voxels.rowwise() += (mins- Voxels.colwise().minCoeff());
 
 
-			std::unique_ptr<kdtree_t> m_kdtree;
-			m_kdtree.reset(new kdtree_t(3, Voxels));
-			m_kdtree->index->buildIndex();
+			// the descriptor only counts the voxels around a vertex: the octree counts nodes inside the sphere
+			// as a whole and only visits the voxels of nodes crossing its boundary
+			std::vector<Vec3> voxel_points(static_cast<size_t>(Voxels.rows()));
+			for (Eigen::Index v = 0; v < Voxels.rows(); ++v)
+				voxel_points[v] = Vec3(static_cast<float>(Voxels(v, 0)), static_cast<float>(Voxels(v, 1)), static_cast<float>(Voxels(v, 2)));
+			Octree voxel_octree(voxel_points);
+			voxel_octree.build(64);
 			//Eigen::MatrixXd descriptors(mesh.vertices().rows(),1);
 
 			//descriptor list with just value to vertex index
@@ -123,22 +129,21 @@ namespace MeshSamplers
 			size_t maxFeatureVal = 0;
 			for (size_t i = 0; i < mesh.vertices().rows();++i)
 			{
-				std::vector<std::pair<Eigen::Index, double>> ret;
-				double pt[3]{ mesh.vertices()(i,0), mesh.vertices()(i,1), mesh.vertices()(i,2) };
-				m_kdtree->index->radiusSearch(&pt[0], (this->voxelScale*5)*(this->voxelScale*5), ret, nanoflann::SearchParams(0, 0.0, false));
+				const Vec3 vertex(static_cast<float>(mesh.vertices()(i, 0)), static_cast<float>(mesh.vertices()(i, 1)), static_cast<float>(mesh.vertices()(i, 2)));
+				const size_t count = voxel_octree.count_radius(vertex, static_cast<float>(this->voxelScale * 5));
 				
 				//mesh color stuff
-				descr[i] = { ret.size(), i };
-				if (ret.size() > maxFeatureVal)
-					maxFeatureVal = ret.size();
+				descr[i] = { count, i };
+				if (count > maxFeatureVal)
+					maxFeatureVal = count;
 
 				//filling histogram stuff
-				if (descrHist.count(ret.size()) == 0)
+				if (descrHist.count(count) == 0)
 				{
-					descrHist.insert({ ret.size(),{} });
+					descrHist.insert({ count,{} });
 				}
-				descrHist[ret.size()].first += 1;
-				descrHist[ret.size()].second.push_back(i);
+				descrHist[count].first += 1;
+				descrHist[count].second.push_back(i);
 			}
 			//coloring, vector index is still identical to row index
 			for (size_t i = 0; i < mesh.vertices().rows(); ++i)
@@ -159,8 +164,8 @@ namespace MeshSamplers
 			});
 
 			//Go through first some % rarest features and add them to our output
-			Eigen::MatrixXd memes(size_t(mesh.vertices().rows()*this->featureCountScale), 3);
-			Eigen::MatrixXd memesNormal(size_t(mesh.vertices().rows() * this->featureCountScale), 3);
+			PointMatrix<Scalar> memes(size_t(mesh.vertices().rows()*this->featureCountScale), 3);
+			PointMatrix<Scalar> memesNormal(size_t(mesh.vertices().rows() * this->featureCountScale), 3);
 			size_t cntr = 0;
 			for (auto d : descrHist2)
 			{	
@@ -178,10 +183,10 @@ namespace MeshSamplers
 			if (this->visualize)
 			{
 				igl::opengl::glfw::Viewer view;
-				view.data().set_mesh(mesh.vertices(), mesh.faces());
+				view.data().set_mesh(toMatrixXd(mesh.vertices()), mesh.faces());
 				view.data().set_colors(cs);
 				view.data().add_points(Eigen::RowVector3d(0, 0, 0), Eigen::RowVector3d(1, 1, 0));
-				view.data().add_points(memes, Eigen::RowVector3d(0, 1, 0));
+				view.data().add_points(toMatrixXd(memes), Eigen::RowVector3d(0, 1, 0));
 				view.data().point_size = 5.0;
 				view.launch();
 			}
@@ -3,62 +3,118 @@
 #include <Eigen/Dense>
 //#include <Octree.h>
 #include <vector>
-#include <igl/adjacency_list.h>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <nanoflann.hpp>
+#include <mesh_connectivity.h>
+#include <cotan_laplacian.h>
+#include <point_matrix.h>
 
 //#define MESH_OCTREE_LEAF_SIZE 5
-using kdtree_t = nanoflann::KDTreeEigenMatrixAdaptor<Eigen::MatrixXd, 3, nanoflann::metric_L2>;
+using kdtree_t = PointKdTree<double>;
 
-class Mesh
+// triangle mesh with the vertex positions and normals stored in Scalar (double or float); derived data and
+// reductions that need the precision (curvature, ICP statistics) are computed in double by their users
+template <typename Scalar>
+class MeshT
 {
 public:
-	Mesh();
+	using points_type = PointMatrix<Scalar>;
+	using kdtree_type = PointKdTree<Scalar>;
 
-	Mesh(const Eigen::MatrixXd& _vertices,
-		const Eigen::MatrixXd& _normals,
+	MeshT();
+
+	// vertices and normals are stored row-major N x 3, column-major matrices of the same scalar type convert implicitly
+	MeshT(const points_type& _vertices,
+		const points_type& _normals,
 		const Eigen::MatrixXi& _faces);
 
-	Mesh(const Eigen::MatrixXd& _vertices,
-		const Eigen::MatrixXd& _normals,
+	MeshT(const points_type& _vertices,
+		const points_type& _normals,
 		const Eigen::MatrixXi& _faces,
 		const Eigen::MatrixXd& _colors);
 
-	Mesh(Eigen::MatrixXd&& _vertices,
-		Eigen::MatrixXd&& _normals,
+	MeshT(points_type&& _vertices,
+		points_type&& _normals,
 		Eigen::MatrixXi&& _faces);
 
-	Mesh(Eigen::MatrixXd&& _vertices,
-		Eigen::MatrixXd&& _normals,
+	MeshT(points_type&& _vertices,
+		points_type&& _normals,
 		Eigen::MatrixXi&& _faces,
 		Eigen::MatrixXd& _colors);
 
-	Mesh(const Mesh& _other);
-	Mesh(Mesh&& _other);
-	Mesh& operator=(const Mesh& _other);
-	Mesh& operator=(Mesh&& _other);
+	MeshT(const MeshT& _other);
+	MeshT(MeshT&& _other);
+	MeshT& operator=(const MeshT& _other);
+	MeshT& operator=(MeshT&& _other);
 
-	const Eigen::MatrixXd& vertices() const { return m_vertices; }
-	const Eigen::MatrixXd& normals() const { return m_normals; }
+	const points_type& vertices() const { return m_vertices; }
+	const points_type& normals() const { return m_normals; }
 	const Eigen::MatrixXi& faces() const { return m_faces; }
 	const Eigen::MatrixXd& colors() const { return m_colors; }
-	Eigen::MatrixXd& vertices() { return m_vertices; }
-	Eigen::MatrixXd& normals() { return m_normals; }
-	Eigen::MatrixXi& faces() { return m_faces; }
+	points_type& normals() { return m_normals; }
 	Eigen::MatrixXd& colors() { return m_colors; }
-	const std::vector<std::vector<Eigen::DenseIndex>>& adjacency_list() const { return m_adjacency_list; }
-	const kdtree_t& kdtree() const { return *m_kdtree.get(); };
-	const std::vector<std::vector<Eigen::DenseIndex>>& triangle_list() const { return m_triangle_list; }
+	// write access drops the derived structures depending on the returned matrix, they are rebuilt on next use;
+	// references to them obtained before are invalidated as well
+	points_type& mutableVertices() { invalidateVertexStructures(); return m_vertices; }
+	Eigen::MatrixXi& mutableFaces() { invalidateFaceStructures(); return m_faces; }
+	// derived structures are built on first access and shared (read-only) between copies of the mesh
+	const MeshConnectivity& connectivity() const;
+	// vertex -> neighbouring vertices and vertex -> incident faces, list v is a span: mesh.adjacency_list()[v]
+	const IndexLists& adjacency_list() const { return connectivity().vertexVertices(); }
+	const IndexLists& triangle_list() const { return connectivity().vertexFaces(); }
+	HalfEdgeView half_edges() const { return HalfEdgeView(m_faces, connectivity().twins()); }
+	const kdtree_type& kdtree() const;
+	// cotangent Laplacian and Voronoi vertex areas of the current vertices (assembled in double); callers that
+	// deform the mesh or need weighted variants copy it or refill their own matrices with its pattern
+	const CotanLaplacian& cotan_laplacian() const;
+	// the same, co-owned: holders (solvers) keep it alive after the mesh changes and can tell it from the rebuilt one
+	std::shared_ptr<const CotanLaplacian> shared_cotan_laplacian() const;
+	// drop the cached structure, it is rebuilt from the current data on next access
 	void recalculateKdTree();
-	void recalculateTriangleList();
+	void recalculateConnectivity();
+	void recalculateCotanLaplacian();
 private:
-	Eigen::MatrixXd m_vertices;
+	// one lazily built structure: the shared_ptr owns it (and is shared by copies), the raw pointer is the
+	// lock free fast path for readers; both only change under m_cache_mutex or through non-const access
+	template <typename T>
+	struct Cached
+	{
+		std::shared_ptr<const T> owner;
+		std::atomic<const T*> ptr{ nullptr };
+
+		void set(std::shared_ptr<const T> value) { owner = std::move(value); ptr.store(owner.get(), std::memory_order_release); }
+	};
+
+	// the kd-tree adaptor only references its points: it is built over a snapshot of the vertices held next to it,
+	// so copies of the mesh can share it
+	struct KdTreeIndex
+	{
+		points_type points;
+		kdtree_type kdtree;
+
+		explicit KdTreeIndex(const points_type& _points) : points(_points), kdtree(3, points) {}
+	};
+
+	template <typename T, typename Builder>
+	const T& getCached(Cached<T>& cache, Builder build) const;
+	void copyCaches(const MeshT& _other);
+	void invalidateVertexStructures();
+	void invalidateFaceStructures();
+
+	points_type m_vertices;
 	Eigen::MatrixXi m_faces;
-	Eigen::MatrixXd m_normals;
+	points_type m_normals;
 	Eigen::MatrixXd m_colors;
-	std::vector<std::vector<Eigen::DenseIndex>> m_adjacency_list;
-	std::vector<std::vector<Eigen::DenseIndex>> m_triangle_list;
-	std::unique_ptr<kdtree_t> m_kdtree;
+	mutable Cached<MeshConnectivity> m_connectivity;
+	mutable Cached<KdTreeIndex> m_kdtree;
+	mutable Cached<CotanLaplacian> m_cotan_laplacian;
+	mutable std::mutex m_cache_mutex;
 };
 
+using Mesh = MeshT<double>;
+using Meshf = MeshT<float>;
+
 
 #endif
\ No newline at end of file
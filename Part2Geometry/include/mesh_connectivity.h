@@ -0,0 +1,90 @@
+#ifndef _MESH_CONNECTIVITY_H_
+#define _MESH_CONNECTIVITY_H_
+#include <Eigen/Dense>
+#include <vector>
+#include <cstddef>
+
+// non-owning view of a contiguous run of indices
+class IndexSpan
+{
+public:
+	IndexSpan(const int* _begin, const int* _end) : m_begin(_begin), m_end(_end) {}
+
+	const int* begin() const { return m_begin; }
+	const int* end() const { return m_end; }
+	std::size_t size() const { return static_cast<std::size_t>(m_end - m_begin); }
+	bool empty() const { return m_begin == m_end; }
+	const int& operator[](std::size_t i) const { return m_begin[i]; }
+private:
+	const int* m_begin;
+	const int* m_end;
+};
+
+// compressed sparse row index lists: the entries of list r are indices[offsets[r], offsets[r + 1])
+class IndexLists
+{
+public:
+	IndexLists() : m_offsets(1, 0) {}
+
+	std::size_t size() const { return m_offsets.size() - 1; }
+	IndexSpan operator[](std::size_t r) const { return IndexSpan(m_indices.data() + m_offsets[r], m_indices.data() + m_offsets[r + 1]); }
+	const std::vector<int>& offsets() const { return m_offsets; }
+	const std::vector<int>& indices() const { return m_indices; }
+	std::size_t memoryUsage() const { return (m_offsets.capacity() + m_indices.capacity()) * sizeof(int); }
+private:
+	friend class MeshConnectivity;
+	std::vector<int> m_offsets;
+	std::vector<int> m_indices;
+};
+
+// half-edge h = 3 * f + k runs from faces(f, k) to faces(f, (k + 1) % 3), so only the twins need storage
+class HalfEdgeView
+{
+public:
+	HalfEdgeView(const Eigen::MatrixXi& _faces, const std::vector<int>& _twins) : m_faces(&_faces), m_twins(&_twins) {}
+
+	int size() const { return static_cast<int>(m_twins->size()); }
+	static int face(int h) { return h / 3; }
+	static int next(int h) { return h % 3 == 2 ? h - 2 : h + 1; }
+	static int prev(int h) { return h % 3 == 0 ? h + 2 : h - 1; }
+	int from(int h) const { return (*m_faces)(h / 3, h % 3); }
+	int to(int h) const { return (*m_faces)(h / 3, (h + 1) % 3); }
+	// vertex of the face opposite to the half-edge
+	int apex(int h) const { return (*m_faces)(h / 3, (h + 2) % 3); }
+	// half-edge of the neighbouring face running the other way, -1 on the boundary
+	int twin(int h) const { return (*m_twins)[static_cast<std::size_t>(h)]; }
+	// half-edge of face f starting at vertex v, -1 if f does not contain v
+	int outgoing(int f, int v) const
+	{
+		for (int k = 0; k < 3; ++k)
+			if ((*m_faces)(f, k) == v)
+				return 3 * f + k;
+		return -1;
+	}
+private:
+	const Eigen::MatrixXi* m_faces;
+	const std::vector<int>* m_twins;
+};
+
+// vertex -> vertex and vertex -> face adjacency of a triangle mesh together with the half-edge twins.
+// Lists are sorted ascending, the build runs a counting pass and a prefix sum and is parallel over faces/vertices.
+class MeshConnectivity
+{
+public:
+	MeshConnectivity(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, std::size_t num_threads = 0);
+
+	const IndexLists& vertexVertices() const { return m_vertex_vertices; }
+	const IndexLists& vertexFaces() const { return m_vertex_faces; }
+	const std::vector<int>& twins() const { return m_twins; }
+	std::size_t memoryUsage() const { return m_vertex_vertices.memoryUsage() + m_vertex_faces.memoryUsage() + m_twins.capacity() * sizeof(int); }
+private:
+	void buildVertexFaces(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, int num_threads);
+	void buildVertexVertices(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, int num_threads);
+	void buildTwins(const Eigen::MatrixXi& faces, int num_threads);
+
+	IndexLists m_vertex_vertices;
+	IndexLists m_vertex_faces;
+	std::vector<int> m_twins;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _MESH_MULTIGRID_H_
+#define _MESH_MULTIGRID_H_
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <vector>
+#include <cstddef>
+
+// multigrid for symmetric positive definite Laplace systems on meshes (full symmetric storage, one row per vertex).
+// Coarse levels cluster every vertex with its strongly coupled neighbours (aggregation on the matrix graph, i.e. the
+// mesh edges), the prolongation is the cluster indicator smoothed by one Jacobi step, restriction its transpose and
+// the coarse operators are the Galerkin products R A P. A V-cycle runs l1-Jacobi smoothing (parallel sparse products, always
+// convergent) before and after the coarse correction and solves the coarsest level directly, so it is symmetric and
+// serves as a preconditioner (Eigen's ConjugateGradient<..., MeshMultigrid>) or as a stand-alone solver.
+// A level with too few strong couplings to shrink is clustered along all of its couplings instead; if even that
+// stalls (nearly decoupled rows), a coarsest level above max_direct_size is solved by Jacobi preconditioned
+// conjugate gradients rather than factorized. Setup, memory and the cost of a cycle grow linearly with the number of
+// vertices. The cycle works in vectors of
+// the levels, so one instance solves from one thread at a time.
+class MeshMultigrid
+{
+public:
+	using matrix_t = Eigen::SparseMatrix<double, Eigen::RowMajor>;
+
+	MeshMultigrid() = default;
+	template <typename MatrixType>
+	explicit MeshMultigrid(const MatrixType& A) { compute(A); }
+
+	// Eigen preconditioner interface; the hierarchy depends on the values, so all of the setup is in factorize()
+	template <typename MatrixType>
+	MeshMultigrid& analyzePattern(const MatrixType&) { return *this; }
+	template <typename MatrixType>
+	MeshMultigrid& factorize(const MatrixType& A) { setup(matrix_t(A)); return *this; }
+	template <typename MatrixType>
+	MeshMultigrid& compute(const MatrixType& A) { return factorize(A); }
+	// one V-cycle from zero, an approximation of A^-1 b
+	Eigen::VectorXd solve(const Eigen::VectorXd& b) const;
+	Eigen::ComputationInfo info() const { return m_info; }
+
+	// stand-alone solver: V-cycles on the residual until |b - A x| <= tolerance * |b|, returns the number of cycles
+	std::size_t solveIterative(const Eigen::VectorXd& b, Eigen::VectorXd& x, double tolerance = 1e-8, std::size_t max_cycles = 100) const;
+
+	std::size_t numLevels() const { return m_levels.size(); }
+	Eigen::Index levelSize(std::size_t level) const { return m_levels[level].A.rows(); }
+	// non-zeros of all level operators relative to the finest one
+	double operatorComplexity() const;
+
+	// levels stop shrinking at this size, the coarsest one is factorized up to max_direct_size rows
+	static constexpr Eigen::Index coarse_size = 1000;
+	static constexpr Eigen::Index max_direct_size = 5000;
+	// relative residual of the iterative coarsest level solve, tight enough to keep the cycle a fixed linear operator
+	static constexpr double coarse_tolerance = 1e-10;
+	static constexpr std::size_t smoothing_steps = 2;
+	// |A(i, j)| >= strength_threshold * sqrt(|A(i, i) A(j, j)|) couples i and j strongly
+	static constexpr double strength_threshold = 0.08;
+private:
+	struct Level
+	{
+		matrix_t A;
+		// inverse l1 row norms, the l1-Jacobi smoother
+		Eigen::VectorXd inv_l1;
+		// to the next coarser level and back
+		matrix_t R;
+		matrix_t P;
+		// work vectors of the cycle
+		mutable Eigen::VectorXd x, b, r;
+	};
+
+	void setup(matrix_t A);
+	void cycle(std::size_t level) const;
+
+	std::vector<Level> m_levels;
+	Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> m_coarse_solver;
+	// used instead of m_coarse_solver when the coarsest level is larger than max_direct_size
+	Eigen::ConjugateGradient<matrix_t, Eigen::Lower | Eigen::Upper> m_coarse_iterative_solver;
+	bool m_coarse_direct = true;
+	Eigen::ComputationInfo m_info = Eigen::InvalidInput;
+};
+
+#endif
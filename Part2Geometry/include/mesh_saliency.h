@@ -2,9 +2,6 @@
 #define _MESH_SALIENCY_H_
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
-#include <igl/cotmatrix.h>
-#include <igl/massmatrix.h>
-#include <igl/invert_diag.h>
 #include <Octree.h>
 #include <cmath>
 #include <mesh.h>
@@ -15,32 +12,49 @@ enum class ScaleType
 	LINEAR_INCREASE
 };
 
-void calculateMeshSaliency(const Mesh& mesh, double scale_base, std::size_t start_scale, std::size_t end_scale, Eigen::VectorXd& vertex_saliency, ScaleType scale_type = ScaleType::LINEAR_INCREASE);
+// how the gaussian pyramid of mean curvature is smoothed: weighted averages over kd-tree radius searches
+// (cost grows with sigma^2 on dense scans), implicit heat diffusion on the mesh (cost independent of sigma) or
+// the radius search averages with octree far-field aggregates (Barnes-Hut style)
+enum class SmoothingType
+{
+	RADIUS_SEARCH,
+	HEAT_DIFFUSION,
+	HIERARCHICAL
+};
+
+// instantiated for Mesh and Meshf, the curvature and the gaussian pyramid are computed in double either way;
+// the radius search pyramid runs one search per vertex for all scales, parallel over vertices (num_threads 0 = all cores)
+template <typename Scalar>
+void calculateMeshSaliency(const MeshT<Scalar>& mesh, double scale_base, std::size_t start_scale, std::size_t end_scale, Eigen::VectorXd& vertex_saliency, ScaleType scale_type = ScaleType::LINEAR_INCREASE, SmoothingType smoothing_type = SmoothingType::RADIUS_SEARCH, std::size_t num_threads = 0);
 
 namespace MeshSamplers
 {
 	struct MeshSaliencySampler
 	{
-		MeshSaliencySampler(double scale_base, std::size_t start_scale, std::size_t end_scale, bool normalize = false, double max_salient_points_fraction = 0.1, ScaleType scale_type = ScaleType::LINEAR_INCREASE, bool visualize = false) :
+		MeshSaliencySampler(double scale_base, std::size_t start_scale, std::size_t end_scale, bool normalize = false, double max_salient_points_fraction = 0.1, ScaleType scale_type = ScaleType::LINEAR_INCREASE, bool visualize = false, std::size_t num_threads = 0, SmoothingType smoothing_type = SmoothingType::RADIUS_SEARCH) :
 			m_scale_base(scale_base),
 			m_start_scale(start_scale),
 			m_end_scale(end_scale),
 			m_normalize(normalize),
 			m_max_sal_point_fraction(max_salient_points_fraction),
 			m_scale_type(scale_type),
-			m_visualize(visualize)
+			m_visualize(visualize),
+			m_num_threads(num_threads),
+			m_smoothing_type(smoothing_type)
 		{}
 
+		template <typename Scalar>
 		void sampleMeshPoints(
-			const Mesh& mesh,
-			Eigen::MatrixXd& sampled_points,
-			Eigen::MatrixXd& sampled_normals
+			const MeshT<Scalar>& mesh,
+			PointMatrix<Scalar>& sampled_points,
+			PointMatrix<Scalar>& sampled_normals
 		);		
 
+		template <typename Scalar>
 		void sampleMeshPoints(
-			const Mesh& mesh,
-			Eigen::MatrixXd& sampled_points,
-			Eigen::MatrixXd& sampled_normals,
+			const MeshT<Scalar>& mesh,
+			PointMatrix<Scalar>& sampled_points,
+			PointMatrix<Scalar>& sampled_normals,
 			Eigen::VectorXd& mesh_saliency
 		);
 
@@ -52,6 +66,8 @@ namespace MeshSamplers
 		double m_max_sal_point_fraction;
 		ScaleType m_scale_type;
 		bool m_visualize;
+		std::size_t m_num_threads;
+		SmoothingType m_smoothing_type;
 	};
 }
 
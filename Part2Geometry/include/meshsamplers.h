@@ -9,10 +9,11 @@ namespace MeshSamplers
 
 	struct PassthroughSampler
 	{
+		template <typename Scalar>
 		static void sampleMeshPoints(
-			const Mesh& mesh,
-			Eigen::MatrixXd& sampled_points,
-			Eigen::MatrixXd& sampled_normals
+			const MeshT<Scalar>& mesh,
+			PointMatrix<Scalar>& sampled_points,
+			PointMatrix<Scalar>& sampled_normals
 		)
 		{
 			sampled_points = mesh.vertices();
@@ -0,0 +1,34 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+#include <cstddef>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// thin helpers around OpenMP so the code still builds (single threaded) without it
+namespace Parallel
+{
+	// number of threads to use for a parallel region; 0 means "all available cores"
+	inline int numThreads(std::size_t requested = 0)
+	{
+#ifdef _OPENMP
+		if (requested == 0)
+			return omp_get_max_threads();
+		return static_cast<int>(requested);
+#else
+		return 1;
+#endif
+	}
+
+	// index of the calling thread inside the current parallel region
+	inline int threadIndex()
+	{
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+}
+
+#endif
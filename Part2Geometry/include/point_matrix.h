@@ -0,0 +1,45 @@
+#ifndef _POINT_MATRIX_H_
+#define _POINT_MATRIX_H_
+#include <Eigen/Dense>
+#include <nanoflann.hpp>
+#include <stdexcept>
+
+// N x 3 row-major point storage: the coordinates of one point are contiguous, so per-point access touches a
+// single cache line and nanoflann queries can point straight into a row (points.row(i).data())
+template <typename Scalar>
+using PointMatrix = Eigen::Matrix<Scalar, Eigen::Dynamic, 3, Eigen::RowMajor>;
+using points_t = PointMatrix<double>;
+using pointsf_t = PointMatrix<float>;
+
+// kd-tree over a point matrix; the adaptor only references the matrix, which has to outlive it
+template <typename Scalar>
+using PointKdTree = nanoflann::KDTreeEigenMatrixAdaptor<PointMatrix<Scalar>, 3, nanoflann::metric_L2>;
+
+// conversion shim for code still holding column-major / dynamic width matrices (Eigen::MatrixXd, igl output);
+// const references convert implicitly, this is for the places where the width has to be checked or the
+// scalar type changes
+template <typename Scalar = double, typename Derived>
+PointMatrix<Scalar> toPointMatrix(const Eigen::MatrixBase<Derived>& matrix)
+{
+	if (matrix.cols() != 3)
+		throw std::invalid_argument("toPointMatrix: expected an N x 3 matrix.\n");
+	return matrix.template cast<Scalar>();
+}
+
+template <typename Scalar>
+Eigen::MatrixXd toMatrixXd(const PointMatrix<Scalar>& points)
+{
+	return points.template cast<double>();
+}
+
+// centroid accumulated in double whatever the storage precision
+template <typename Scalar>
+Eigen::Vector3d pointMean(const PointMatrix<Scalar>& points)
+{
+	Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+	for (Eigen::Index i = 0; i < points.rows(); ++i)
+		sum += points.row(i).transpose().template cast<double>();
+	return points.rows() > 0 ? Eigen::Vector3d(sum / static_cast<double>(points.rows())) : sum;
+}
+
+#endif
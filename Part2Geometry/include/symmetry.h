@@ -6,6 +6,12 @@
 #include <icp.h>
 #include <chrono>
 #include <mesh.h>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <parallel.h>
+#include <random>
 
 struct SymmetryResult
 {
@@ -13,13 +19,22 @@ struct SymmetryResult
 	Eigen::Vector3d normal;
 	Eigen::Vector3d trans;
 	Eigen::Matrix3d rot;
-	Eigen::MatrixXd refVt;
-	Eigen::MatrixXd refVq;
+	points_t refVt;
+	points_t refVq;
 	double time_for_prefiltering;
 	double time_for_alignment;
 	double time_for_sym_calculation;
 	double time_total;
+	// NaN if the result was not evaluated (the lower ranked hypotheses of findMainSymmetryPlane)
 	double whole_mesh_mae;
+	// half width of the 95% confidence interval of whole_mesh_mae, 0 if every vertex was evaluated
+	double whole_mesh_mae_confidence;
+	double time_for_mae_evaluation;
+	// ICP iterations until convergence (time_for_alignment is the matching time) and whether it converged
+	std::size_t icp_iterations;
+	bool icp_converged;
+	// final ICP error, used to rank plane hypotheses
+	double icp_error;
 };
 
 void reflectAlongPlane(const SymmetryResult &sres, Eigen::MatrixXd& vertices) {
@@ -33,59 +48,233 @@ void reflectAlongPlane(const SymmetryResult &sres, Eigen::MatrixXd& vertices) {
 	vertices.rowwise() += 2.0 * origin_plane_distance * sres.normal.transpose();
 }
 
-template <typename MeshSampler>
+// n roughly uniform plane normals on the upper hemisphere (Fibonacci lattice), n and -n describe the same plane
+inline std::vector<Eigen::Vector3d> sampleHemisphereNormals(std::size_t n)
+{
+	std::vector<Eigen::Vector3d> normals;
+	normals.reserve(n);
+	const double golden_angle = 3.14159265358979323846 * (3.0 - std::sqrt(5.0));
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		double z = 1.0 - (static_cast<double>(i) + 0.5) / static_cast<double>(n);
+		double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+		double phi = golden_angle * static_cast<double>(i);
+		normals.emplace_back(r * std::cos(phi), r * std::sin(phi), z);
+	}
+	return normals;
+}
+
+// mean distance of the mesh vertices, reflected across the plane, to their nearest original vertex;
+// max_samples > 0 evaluates one random vertex per each of max_samples equally sized index strata instead
+// of all vertices, confidence receives the half width of the 95% interval of that estimate
+template <typename Scalar>
+double calcReflectedMeshMAE(const MeshT<Scalar>& mesh, const Eigen::Vector3d& plane_point, const Eigen::Vector3d& plane_normal, std::size_t max_samples, std::size_t num_threads, double& confidence)
+{
+	const Eigen::DenseIndex num_vertices = mesh.vertices().rows();
+	const bool subsample = max_samples > 0 && static_cast<Eigen::DenseIndex>(max_samples) < num_vertices;
+	const Eigen::DenseIndex num_samples = subsample ? static_cast<Eigen::DenseIndex>(max_samples) : num_vertices;
+	confidence = 0.0;
+	if (num_samples == 0)
+		return 0.0;
+
+	std::vector<Eigen::DenseIndex> samples;
+	if (subsample)
+	{
+		// jittered stratification over the vertex order, which follows the scan and is spatially coherent
+		samples.resize(static_cast<std::size_t>(num_samples));
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<double> jitter(0.0, 1.0);
+		double stratum_size = static_cast<double>(num_vertices) / static_cast<double>(num_samples);
+		for (Eigen::DenseIndex i = 0; i < num_samples; ++i)
+			samples[static_cast<std::size_t>(i)] = std::min(num_vertices - 1, static_cast<Eigen::DenseIndex>((static_cast<double>(i) + jitter(rng)) * stratum_size));
+	}
+
+	const Eigen::Vector3d normal = plane_normal.normalized();
+	const Eigen::Matrix3d reflection_matrix = Eigen::Matrix3d::Identity() - 2.0 * normal * normal.transpose();
+	const Eigen::Vector3d reflection_offset = 2.0 * plane_point.dot(normal) * normal;
+	const typename MeshT<Scalar>::kdtree_type& kdtree = mesh.kdtree();
+	double sum = 0.0;
+	double sum_sq = 0.0;
+#pragma omp parallel for schedule(static) num_threads(Parallel::numThreads(num_threads)) reduction(+:sum, sum_sq)
+	for (Eigen::DenseIndex i = 0; i < num_samples; ++i)
+	{
+		Eigen::DenseIndex v = subsample ? samples[static_cast<std::size_t>(i)] : i;
+		Eigen::Matrix<Scalar, 3, 1> reflected = (reflection_matrix * mesh.vertices().row(v).transpose().template cast<double>() + reflection_offset).template cast<Scalar>();
+		Eigen::DenseIndex nnidx;
+		Scalar squared_distance;
+		kdtree.query(reflected.data(), 1, &nnidx, &squared_distance);
+		double distance = std::sqrt(static_cast<double>(squared_distance));
+		sum += distance;
+		sum_sq += distance * distance;
+	}
+
+	double mean = sum / static_cast<double>(num_samples);
+	if (subsample && num_samples > 1)
+	{
+		// the sample variance bounds the variance of the stratified estimate from above
+		double variance = std::max(0.0, (sum_sq - num_samples * mean * mean) / static_cast<double>(num_samples - 1));
+		confidence = 1.96 * std::sqrt(variance / static_cast<double>(num_samples));
+	}
+	return mean;
+}
+
+// Scalar selects the storage precision of the mesh, the sampled points and the ICP kd-tree; plane estimation
+// and error accumulation are done in double either way
+template <typename MeshSampler, typename Scalar = double>
 class SymmetryDetector
 {
 public:
-	SymmetryDetector(const ICPParams& icpparams = {}, const MeshSampler& meshsampler = {}) :
+	using mesh_type = MeshT<Scalar>;
+	using points_type = PointMatrix<Scalar>;
+	using aligner_type = ICPAlignerT<Scalar>;
+
+	SymmetryDetector(const ICPParams& icpparams = {}, const MeshSampler& meshsampler = {}, std::size_t mae_max_samples = 0) :
 		m_meshsampler(meshsampler),
-		m_icp_params(icpparams)
+		m_icp_params(icpparams),
+		m_mae_max_samples(mae_max_samples)
 	{}
 
-	SymmetryResult findMainSymmetryPlane(const Mesh& mesh, const Eigen::Vector3d& initial_plane_normal)
+	SymmetryResult findMainSymmetryPlane(const mesh_type& mesh, const Eigen::Vector3d& initial_plane_normal)
 	{
 		auto t0 = std::chrono::high_resolution_clock::now();
 		// --- sample points on mesh ---
 		std::cout << "--- Symmetry detection: prefiltering input mesh...\n";
-		Eigen::MatrixXd Vt;
-		Eigen::MatrixXd Nt;
+		points_type Vt;
+		points_type Nt;
+		auto t1 = std::chrono::high_resolution_clock::now();
+		m_meshsampler.sampleMeshPoints(mesh, Vt, Nt);
+		auto t_prefiltering = std::chrono::high_resolution_clock::now() - t1;
+
+		// icp instance
+		aligner_type icp(Vt);
+		SymmetryResult result = alignPlaneHypothesis(icp, m_icp_params, Vt, Nt, initial_plane_normal);
+		evaluateWholeMesh(mesh, result);
+
+		auto t_total = std::chrono::high_resolution_clock::now() - t0;
+		result.time_for_prefiltering = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_prefiltering).count()) * 1e-6;
+		result.time_total = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_total).count()) * 1e-6;
+		return result;
+	}
+
+	// runs the plane alignment from num_hypotheses normals spread over the hemisphere in parallel, the mesh is
+	// sampled and the target kd-tree built only once; ranked_results is sorted by final ICP error, best first.
+	// Only the best result gets the whole mesh evaluation, pass others to evaluateWholeMesh if needed
+	SymmetryResult findMainSymmetryPlane(const mesh_type& mesh, std::size_t num_hypotheses, std::vector<SymmetryResult>& ranked_results)
+	{
+		auto t0 = std::chrono::high_resolution_clock::now();
+		std::cout << "--- Symmetry detection: prefiltering input mesh...\n";
+		points_type Vt;
+		points_type Nt;
 		auto t1 = std::chrono::high_resolution_clock::now();
 		m_meshsampler.sampleMeshPoints(mesh, Vt, Nt);
 		auto t_prefiltering = std::chrono::high_resolution_clock::now() - t1;
+		double time_for_prefiltering = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_prefiltering).count()) * 1e-6;
+
+		// every hypothesis works on a copy of this aligner, the copies share its read-only kd-tree
+		const aligner_type icp(Vt);
+		std::vector<Eigen::Vector3d> plane_normals = sampleHemisphereNormals(num_hypotheses);
+		ranked_results.assign(plane_normals.size(), SymmetryResult{});
+		std::vector<char> succeeded(plane_normals.size(), 0);
+		// the hypotheses run concurrently, their progress output would interleave
+		ICPParams hypothesis_params(m_icp_params);
+		hypothesis_params.verbose = false;
 
+		std::cout << "--- Symmetry detection: aligning " << plane_normals.size() << " plane hypotheses...\n";
+		// one hypothesis per thread, the parallel loops inside ICP run single threaded in this region
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Parallel::numThreads(m_icp_params.num_threads))
+		for (long h = 0; h < static_cast<long>(plane_normals.size()); ++h)
+		{
+			// exceptions must not leave the parallel region, a failed hypothesis is simply dropped
+			try
+			{
+				aligner_type hypothesis_icp(icp);
+				ranked_results[h] = alignPlaneHypothesis(hypothesis_icp, hypothesis_params, Vt, Nt, plane_normals[h]);
+				ranked_results[h].time_for_prefiltering = time_for_prefiltering;
+				succeeded[h] = 1;
+			}
+			catch (const std::exception& ex)
+			{
+				std::cerr << "--- Symmetry detection: hypothesis " << h << " failed: " << ex.what() << "\n";
+			}
+		}
+
+		std::size_t num_succeeded = 0;
+		for (std::size_t h = 0; h < ranked_results.size(); ++h)
+		{
+			if (succeeded[h])
+				ranked_results[num_succeeded++] = ranked_results[h];
+		}
+		ranked_results.resize(num_succeeded);
+		if (ranked_results.empty())
+			throw std::logic_error("Symmetry detection: all plane hypotheses failed.\n");
+		std::sort(ranked_results.begin(), ranked_results.end(), [](const SymmetryResult& a, const SymmetryResult& b) { return a.icp_error < b.icp_error; });
+		for (auto& result : ranked_results)
+		{
+			result.whole_mesh_mae = std::numeric_limits<double>::quiet_NaN();
+			result.whole_mesh_mae_confidence = std::numeric_limits<double>::quiet_NaN();
+		}
+		evaluateWholeMesh(mesh, ranked_results.front());
+
+		auto t_total = std::chrono::high_resolution_clock::now() - t0;
+		for (auto& result : ranked_results)
+			result.time_total = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_total).count()) * 1e-6;
+		std::cout << "--- Symmetry detection: best of " << ranked_results.size() << " hypotheses has error " << ranked_results.front().icp_error << ".\n";
+		return ranked_results.front();
+	}
+
+	// mean absolute error of the whole mesh reflected across the result plane, fills the whole_mesh_mae fields
+	void evaluateWholeMesh(const mesh_type& mesh, SymmetryResult& result) const
+	{
+		std::cout << "--- Symmetry detection: evaluating reflected whole mesh...\n";
+		auto t1 = std::chrono::high_resolution_clock::now();
+		result.whole_mesh_mae = calcReflectedMeshMAE(mesh, result.center, result.normal, m_mae_max_samples, m_icp_params.num_threads, result.whole_mesh_mae_confidence);
+		auto t_mae = std::chrono::high_resolution_clock::now() - t1;
+		result.time_for_mae_evaluation = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_mae).count()) * 1e-6;
+		std::cout << "--- Symmetry detection: whole mesh MAE " << result.whole_mesh_mae << " (+- " << result.whole_mesh_mae_confidence << ").\n";
+	}
+
+private:
+	// reflects the sampled set across the plane through its center of mass with the given normal, aligns it
+	// to the unreflected set and derives the symmetry plane; prefiltering and total time are left to the caller.
+	// icp_params.verbose also switches the progress output of this function
+	SymmetryResult alignPlaneHypothesis(aligner_type& icp, const ICPParams& icp_params, const points_type& Vt, const points_type& Nt, const Eigen::Vector3d& initial_plane_normal) const
+	{
 		// --- find symmetry plane ---
-		Eigen::Vector3d center_of_mass{ Vt.colwise().mean().transpose() };
+		Eigen::Vector3d center_of_mass{ pointMean(Vt) };
 		Eigen::Vector3d plane_normal{ initial_plane_normal };
 
-		// icp instance
-		ICPAligner icp(Vt);
-		// query set copy
-		Eigen::MatrixXd Vq(Vt);
-		Eigen::MatrixXd Nq(Nt);
+		// query set copy, reflected in double
+		points_t Vq = Vt.template cast<double>();
+		points_t Nq = Nt.template cast<double>();
 
 		// construct initial plane and reflection matrix
 		Eigen::Matrix3d reflection_matrix;
 		reflection_matrix << 1, 0, 0, 0, 1, 0, 0, 0, 1;
 		reflection_matrix = reflection_matrix - 2 * (plane_normal * plane_normal.transpose());
 		double origin_plane_distance = (center_of_mass).dot(plane_normal);
-		std::cout << center_of_mass;
 		// reflect query set across initial plane		
 		Vq *= reflection_matrix.transpose();
 		Vq.rowwise() += 2.0 * origin_plane_distance * plane_normal.transpose();
 
 		Nq *= reflection_matrix.transpose();
 		Nq.rowwise().normalize();
+		points_type Vq_aligned = Vq.template cast<Scalar>();
+		points_type Nq_aligned = Nq.template cast<Scalar>();
 
 		// align target and reflected query set
 		Eigen::Matrix3d optimal_rotation;
 		Eigen::Vector3d optimal_translation;
 		//icp.align(optimal_rotation, optimal_translation, Vq, Vt, Nt, Nq, 50.0, 0.2, 1e-2, 1e-4, 100);
-		std::cout << "--- Symmetry detection: calculating optimal rigid transform...\n";
-		t1 = std::chrono::high_resolution_clock::now();
-		icp.align(optimal_rotation, optimal_translation, Vq, Vt, Nt, Nq, m_icp_params);
+		if (icp_params.verbose)
+			std::cout << "--- Symmetry detection: calculating optimal rigid transform...\n";
+		auto t1 = std::chrono::high_resolution_clock::now();
+		double icp_error = icp.align(optimal_rotation, optimal_translation, Vq_aligned, Vt, Nt, Nq_aligned, icp_params);
 		auto t_align = std::chrono::high_resolution_clock::now() - t1;
+		if (icp_params.verbose)
+			std::cout << "--- Symmetry detection: ICP " << (icp.converged() ? "converged" : "stopped") << " after " << icp.numIterations() << " iterations.\n";
 
-		std::cout << "--- Symmetry detection: eigendecomposition of optimally rotated reflection matrix...\n";
+		if (icp_params.verbose)
+			std::cout << "--- Symmetry detection: eigendecomposition of optimally rotated reflection matrix...\n";
 		t1 = std::chrono::high_resolution_clock::now();
 		auto reflected_rot = reflection_matrix * optimal_rotation.transpose();
 		Eigen::EigenSolver<Eigen::MatrixXd> es(reflected_rot);
@@ -102,7 +291,8 @@ public:
 		}
 		
 
-		std::cout << "--- Symmetry detection: calculating result reflection plane...\n";
+		if (icp_params.verbose)
+			std::cout << "--- Symmetry detection: calculating result reflection plane...\n";
 		Eigen::Vector3d newplanepoint = 0.5 * (optimal_rotation * (2 * origin_plane_distance * plane_normal) + optimal_translation);
 		Eigen::Vector3d newnormal = es.eigenvectors().col(smallesteigenidx)(Eigen::all, 0).real();
 
@@ -112,33 +302,37 @@ public:
 		reflection_matrix = reflection_matrix - 2 * (newnormal * newnormal.transpose());
 		origin_plane_distance = (-newplanepoint).dot(newnormal);
 
-		Eigen::MatrixXd Vq_new(Vt);
+		points_t Vq_new = Vt.template cast<double>();
 		// reflect query set across initial plane		
 		Vq_new *= reflection_matrix.transpose();
 		Vq_new.rowwise() += 2.0 * origin_plane_distance * newnormal.transpose();
 
 		// return result
-		std::cout << "--- Symmetry detection: finished.\n";
-
-		auto t_total = std::chrono::high_resolution_clock::now() - t0;
+		if (icp_params.verbose)
+			std::cout << "--- Symmetry detection: finished.\n";
 
 		return { newplanepoint,
 			newnormal,
 			optimal_translation,
 			optimal_rotation,
-			Vt,
+			Vt.template cast<double>(),
 			Vq_new,
-			static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_prefiltering).count()) * 1e-6,
+			0.0,
 			static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_align).count()) * 1e-6,
 			static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_result).count()) * 1e-6,
-			static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t_total).count()) * 1e-6,
-			0.0
+			0.0,
+			0.0,
+			0.0,
+			0.0,
+			icp.numIterations(),
+			icp.converged(),
+			icp_error
 		};
 	}
 
-private:
 	MeshSampler m_meshsampler;
 	ICPParams m_icp_params;
+	std::size_t m_mae_max_samples;
 };
 
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef _TOOTH_SEGMENTATION_H_
 #define _TOOTH_SEGMENTATION_H_
 #include <mesh.h>
+#include <harmonic_field_solver.h>
 #include <Eigen/Dense>
 #include <memory>
 
@@ -27,7 +28,7 @@ public:
 		double os_frac;
 		// optimum shift bandwidth param
 		double os_window_size; // [0, 1] fraction of bounding box diagonal
-		// min change
+		// min change: a particle stops once its own shift is below it, all stop once their summed shift is
 		double os_min_total_shift;
 		// max iterations
 		std::size_t os_max_iterations;
@@ -51,6 +52,16 @@ public:
 		double gamma_high;
 		double gamma_low;
 		double concavity_threshold;
+		// linear solver (AUTOMATIC when left out: multigrid preconditioned CG on large meshes, LDLT otherwise)
+		HarmonicFieldSolver::Method solver;
+	};
+
+	enum class SmoothingScheme
+	{
+		// smoothing_steps forward Euler steps of smoothing_step_size
+		EXPLICIT,
+		// the same smoothing time (smoothing_steps * smoothing_step_size) in implicit_steps backward Euler steps
+		IMPLICIT
 	};
 
 	struct MeanCurvatureParams
@@ -61,6 +72,10 @@ public:
 		double smoothing_steps;
 		// outlier detection
 		double max_zscore;
+		// smoothing scheme (EXPLICIT when left out), the operators are re-assembled on the smoothed mesh before every step
+		SmoothingScheme smoothing_scheme;
+		// number of backward Euler steps (IMPLICIT only, 0 counts as 1), one already smooths as much as the explicit steps
+		std::size_t implicit_steps;
 	};
 
 	struct ToothMeshExtractionParams
@@ -77,7 +92,7 @@ public:
 		std::vector<Mesh>& tooth_meshes,
 		const CuspDetectionParams& cuspd_params = {0.4, 1000, 0.5},
 		const HarmonicFieldParams& hf_params = { 1.0, 1.0 },
-		const MeanCurvatureParams& mc_params = {0.00025, 50, 2.0},
+		const MeanCurvatureParams& mc_params = {0.00025, 50, 2.0, SmoothingScheme::EXPLICIT, 1},
 		const ToothMeshExtractionParams& tme_params = {0.3, 0.7},
 		bool visualize_steps = false);
 
@@ -92,22 +107,28 @@ private:
 		Eigen::VectorXi& features,
 		const CuspDetectionParams& cuspd_params,
 		bool visualize_steps = false);
-	static void calculateHarmonicField(const Mesh& mesh,
+	// solver: built for the mesh and harmonicFieldConstraints(toothFeatures, cut_indices)
+	static void calculateHarmonicField(HarmonicFieldSolver& solver,
+		const Mesh& mesh,
 		const Eigen::VectorXd& mean_curvature,
 		const std::vector<ToothFeature>& toothFeatures,
 		const Eigen::VectorXi& cut_indices,
 		Eigen::VectorXd& harmonic_field,
 		const HarmonicFieldParams& hf_params,
 		bool visualize_steps = false);
+	// feature points of all teeth followed by the cut boundary
+	static std::vector<int> harmonicFieldConstraints(const std::vector<ToothFeature>& toothFeatures,
+		const Eigen::VectorXi& cut_indices);
+	static void checkHarmonicFieldSolver(const HarmonicFieldSolver& solver,
+		const Mesh& mesh,
+		const std::vector<ToothFeature>& toothFeatures,
+		const Eigen::VectorXi& cut_indices);
 	static void cutMesh(Mesh& mesh,
 		Eigen::VectorXi& cut_indices,
 		Eigen::VectorXi& inv_index_map,
 		Eigen::VectorXi& index_map,
 		const Eigen::Vector3d& normal,
 		const Eigen::Vector3d& plane_point);
-	static double calcCotanWeight(const Eigen::Index& i,
-		const Eigen::Index& j,
-		const Mesh& mesh);
 	static double calcCurvatureWeight(const Eigen::Index& i,
 		const Eigen::Index& j,
 		const Eigen::VectorXd& mean_curvature,
@@ -3,6 +3,8 @@
 //
 
 #include <Octree.h>
+#include <parallel.h>
+#include <stdexcept>
 
 //namespace students {
 
@@ -42,40 +44,85 @@ size_t clz(uint64_t x) {
 
 //----------------------------------------------------------------------------------------------------------------------
 
+// out of class definition for the ODR uses (bound to const references, e.g. by std::pair)
+constexpr size_t LocCodeIndex::npos;
+
+//----------------------------------------------------------------------------------------------------------------------
+
 void Octree::clear() {
     indices.clear();
     OctreeBase::clear();
 }
 
-void Octree::build(size_t leaf_size) {
-    init(leaf_size);
+void Octree::build(size_t leaf_size, size_t num_threads) {
+    clear();
+    init(leaf_size, num_threads);
+    create_sorted(num_threads);
+    storage.shrink_to_fit();
+    build_node_index();
+}
+
+void Octree::build_bfs(size_t leaf_size) {
+    clear();
+    init(leaf_size, 1);
     create_bfs();
     storage.shrink_to_fit();
+    build_node_index();
 }
 
 Octree::ResultSet Octree::query_radius(const Vec3 &point, float radius, size_t depth) const {
     ResultSet resultSet;
-    query_radius(0, root_aabb, point, radius, resultSet, depth);
+    query_radius(point, radius, resultSet.idx_dist_pair, depth);
     return resultSet;
 }
 
+size_t Octree::query_radius(const Vec3 &point, float radius, std::vector<std::pair<size_t, float>> &results,
+                            size_t depth) const {
+    results.clear();
+    visit_radius(point, radius, [&results](size_t idx, float squared_dist) {
+        results.emplace_back(idx, squared_dist);
+    }, depth);
+    return results.size();
+}
+
 Octree::ResultSet Octree::query_knn(const Vec3 &point, int k, size_t depth) const {
     ResultSet resultSet(k);
-    query_knn(0, root_aabb, point, resultSet, depth);
+    query_knn(point, k, resultSet, depth);
     return resultSet;
 }
 
-void Octree::init(size_t leaf_size) {
+void Octree::init(size_t leaf_size, size_t num_threads) {
     this->leaf_size = leaf_size;
 
     size_t N = points.size();
     indices = std::vector<size_t>(N);
     root_aabb = AABB();
-
-    for (size_t i = 0; i < N; ++i) {
-        root_aabb.grow(points[i]);
-        indices[i] = i;
+    if (N == 0) return;
+
+    // bounding box as a min / max reduction over chunks, center and halfsize are only formed once at the end
+    const int num_chunks = Parallel::numThreads(num_threads);
+    std::vector<Vec3> chunk_min(num_chunks, points[0]), chunk_max(num_chunks, points[0]);
+#pragma omp parallel for schedule(static) num_threads(num_chunks)
+    for (int c = 0; c < num_chunks; ++c) {
+        Vec3 &min = chunk_min[c];
+        Vec3 &max = chunk_max[c];
+        for (size_t i = N * c / num_chunks; i < N * (c + 1) / num_chunks; ++i) {
+            for (size_t a = 0; a < 3; ++a) {
+                min[a] = std::min(min[a], points[i][a]);
+                max[a] = std::max(max[a], points[i][a]);
+            }
+            indices[i] = i;
+        }
+    }
+    Vec3 min = chunk_min[0], max = chunk_max[0];
+    for (int c = 1; c < num_chunks; ++c) {
+        for (size_t a = 0; a < 3; ++a) {
+            min[a] = std::min(min[a], chunk_min[c][a]);
+            max[a] = std::max(max[a], chunk_max[c][a]);
+        }
     }
+    Vec3 halfsize = (max - min) / 2;
+    root_aabb = AABB(min + halfsize, halfsize);
 }
 
 void Octree::create_bfs() {
@@ -88,7 +135,7 @@ void Octree::create_bfs() {
         AABB &aabb = queue.front();
         depth = std::max(tree_depth(storage[i].loc_code), depth);
 
-        if (storage[i].data.size > leaf_size && tree_depth(storage[i].loc_code) < 21) {
+        if (storage[i].data.size > leaf_size && tree_depth(storage[i].loc_code) < max_depth) {
             std::vector<size_t> buckets[8];
 
             for (size_t j = 0; j < storage[i].data.size; ++j) {
@@ -127,82 +174,727 @@ void Octree::create_bfs() {
     }
 }
 
-void
-Octree::query_radius(size_t index, const AABB &aabb, const Vec3 &point, float radius, ResultSet &resultSet,
-                     size_t depth) const {
-    const Node &node = storage[index];
-
-    if (aabb.is_inside_sphere(point, radius)) {
-        for (size_t i = node.data.start; i < node.data.end; ++i) {
-            resultSet.add_point(indices[i]);
+void Octree::point_codes(const Vec3 *block, size_t count, uint64_t *codes) const {
+    // the centers follow child_center, which adds (bit - 0.5) * halfsize in double and rounds to float. The offset
+    // is exactly +-halfsize / 2 and the double sum is exact (or rounds to the center itself), so a float addition
+    // gives the same bits: a point always lies inside the box of its node. The points of a block descend in
+    // lockstep, which hides the latency of the per point dependency chain; the halfsizes are the same for all.
+    assert(count <= code_block_size);
+    float point[3][code_block_size], center[3][code_block_size];
+    uint64_t code[code_block_size] = {};
+    for (size_t a = 0; a < 3; ++a) {
+        for (size_t j = 0; j < code_block_size; ++j) {
+            point[a][j] = block[std::min(j, count - 1)][a];
+            center[a][j] = root_aabb.center[a];
         }
+    }
+    float halfsize[3] = {root_aabb.halfsize[0], root_aabb.halfsize[1], root_aabb.halfsize[2]};
+    // the points of the tree lie on the center plane of a degenerate axis and go to the lower cell; anything else
+    // would put a point off that plane into the far boundary cell, away from all of them
+    const bool degenerate[3] = {!(halfsize[0] > 0), !(halfsize[1] > 0), !(halfsize[2] > 0)};
+    for (size_t level = 0; level < max_depth; ++level) {
+        for (size_t a = 0; a < 3; ++a) {
+            if (degenerate[a]) continue;
+            halfsize[a] = halfsize[a] / 2;
+            for (size_t j = 0; j < code_block_size; ++j) {
+                bool upper = point[a][j] > center[a][j];
+                code[j] |= static_cast<uint64_t>(upper) << (3 * (max_depth - 1 - level) + a);
+                // branch free, the octant of random points is not predictable
+                center[a][j] += halfsize[a] * (2.0f * upper - 1.0f);
+            }
+        }
+    }
+    std::copy(code, code + count, codes);
+}
+
+using code_item_t = std::pair<uint64_t, size_t>;
+
+// most significant digit first radix sort of items[0, size) on the code bits below shift, 9 bits (three levels) per
+// pass. Ranges of at most leaf_size points are not sorted further: they end up in a single leaf, so only the order
+// of the prefixes matters. Everything else comes out in Morton order.
+static void msd_radix_sort(code_item_t *items, code_item_t *buffer, size_t size, size_t shift, size_t leaf_size) {
+    if (size <= leaf_size || shift == 0) return;
+    if (size <= 64) {
+        std::sort(items, items + size, [](const code_item_t &lhs, const code_item_t &rhs) {
+            return lhs.first < rhs.first;
+        });
         return;
     }
+    shift -= 9;
+    size_t offsets[513] = {};
+    for (size_t i = 0; i < size; ++i) ++offsets[((items[i].first >> shift) & 511) + 1];
+    for (size_t digit = 0; digit < 512; ++digit) offsets[digit + 1] += offsets[digit];
+    size_t cursor[512];
+    std::copy(offsets, offsets + 512, cursor);
+    for (size_t i = 0; i < size; ++i) buffer[cursor[(items[i].first >> shift) & 511]++] = items[i];
+    std::copy(buffer, buffer + size, items);
+    for (size_t digit = 0; digit < 512; ++digit) {
+        msd_radix_sort(items + offsets[digit], buffer + offsets[digit], offsets[digit + 1] - offsets[digit], shift,
+                       leaf_size);
+    }
+}
+
+void Octree::create_sorted(size_t num_threads) {
+    const size_t N = points.size();
+    storage.push_back(Node(0, 1, 0, 0, OctantIndices(0, N - 1, N)));
+    depth = 0;
+    if (N <= leaf_size) return;
+
+    const int num_chunks = Parallel::numThreads(num_threads);
+    std::vector<code_item_t> items(N), buffer(N);
+    const long long num_blocks = static_cast<long long>((N + code_block_size - 1) / code_block_size);
+#pragma omp parallel for schedule(static) num_threads(num_chunks)
+    for (long long block = 0; block < num_blocks; ++block) {
+        size_t first = static_cast<size_t>(block) * code_block_size;
+        size_t count = N - first < code_block_size ? N - first : code_block_size;
+        uint64_t codes[code_block_size];
+        point_codes(&points[first], count, codes);
+        for (size_t j = 0; j < count; ++j) items[first + j] = {codes[j], first + j};
+    }
 
-    if (node.config == 0 || tree_depth(node.loc_code) == depth) {
-        for (size_t i = node.data.start; i < node.data.end; ++i) {
-            size_t idx = indices[i];
-            float dist = (points[idx] - point).length();
-            if (dist < radius) resultSet.add_point(idx);
+    // the first digit is distributed by all threads: counts per chunk, then every chunk scatters into its own slots
+    // (behind the chunks before it) of every digit. The digit ranges are then sorted independently.
+    const size_t shift = 3 * max_depth - 9;
+    std::vector<size_t> offsets(static_cast<size_t>(num_chunks) * 512);
+#pragma omp parallel for schedule(static) num_threads(num_chunks)
+    for (int c = 0; c < num_chunks; ++c) {
+        size_t *count = &offsets[static_cast<size_t>(c) * 512];
+        for (size_t i = N * c / num_chunks; i < N * (c + 1) / num_chunks; ++i) ++count[items[i].first >> shift];
+    }
+    std::vector<size_t> digit_start(513, 0);
+    for (size_t digit = 0; digit < 512; ++digit) {
+        size_t sum = digit_start[digit];
+        for (int c = 0; c < num_chunks; ++c) {
+            size_t &offset = offsets[static_cast<size_t>(c) * 512 + digit];
+            size_t count = offset;
+            offset = sum;
+            sum += count;
         }
-        return;
+        digit_start[digit + 1] = sum;
+    }
+#pragma omp parallel for schedule(static) num_threads(num_chunks)
+    for (int c = 0; c < num_chunks; ++c) {
+        size_t *offset = &offsets[static_cast<size_t>(c) * 512];
+        for (size_t i = N * c / num_chunks; i < N * (c + 1) / num_chunks; ++i) {
+            buffer[offset[items[i].first >> shift]++] = items[i];
+        }
+    }
+    items.swap(buffer);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_chunks)
+    for (int digit = 0; digit < 512; ++digit) {
+        msd_radix_sort(&items[digit_start[digit]], &buffer[digit_start[digit]],
+                       digit_start[digit + 1] - digit_start[digit], shift, leaf_size);
     }
+    for (size_t i = 0; i < N; ++i) indices[i] = items[i].second;
+
+    // the points of every node are a contiguous run of equal code prefixes, in BFS order the nodes come out
+    // exactly as in create_bfs; within a run the octant digit below the prefix is ascending
+    for (size_t i = 0; i < storage.size(); ++i) {
+        size_t level = tree_depth(storage[i].loc_code);
+        depth = std::max(level, depth);
+        if (storage[i].data.size <= leaf_size || level >= max_depth) continue;
+
+        const size_t digit_shift = 3 * (max_depth - level - 1);
+        const auto first = items.begin() + storage[i].data.start;
+        const auto last = first + storage[i].data.size;
+        auto child_first = first;
+        for (uint8_t octant = 0; octant < 8 && child_first != last; ++octant) {
+            auto child_last = std::partition_point(child_first, last, [digit_shift, octant](const code_item_t &item) {
+                return ((item.first >> digit_shift) & 7) <= octant;
+            });
+            if (child_last == child_first) continue;
+            if (storage[i].config == 0) storage[i].first_child_index = storage.size();
+            set_child_exists(storage[i].config, octant);
+
+            size_t child_start = child_first - items.begin();
+            size_t child_size = child_last - child_first;
+            storage.push_back(Node(0, child_loc_code(storage[i].loc_code, octant), 0, i,
+                                   OctantIndices(child_start, child_start + child_size - 1, child_size)));
+            child_first = child_last;
+        }
+    }
+}
 
-    Vec3 child_extent = aabb.halfsize / 2;
-    uint8_t offset = 0;
-    for (uint8_t i = 0; i < 8; ++i) {
-        if (!child_exists(node.config, i)) continue;
-        AABB childBox = child_box(aabb, i, child_extent);
-        if (!childBox.intersect(point, radius)) continue;
-        query_radius(node.first_child_index + offset, childBox, point, radius, resultSet, depth);
-        ++offset;
+std::vector<PointAggregate> Octree::aggregate_points(const std::vector<double> &attributes) const {
+    return aggregate<PointAggregate>([&](PointAggregate &aggregate, size_t idx) {
+        aggregate.add(points[idx], attributes.empty() ? 0.0 : attributes[idx]);
+    });
+}
+
+GaussianSum Octree::gaussian_sum(const std::vector<PointAggregate> &aggregates, const std::vector<double> &attributes,
+                                 const Vec3 &point, float sigma, float radius, double tolerance) const {
+    GaussianSum sum;
+    gaussian_sums(aggregates, attributes, point, &sigma, &radius, 1, tolerance, &sum);
+    return sum;
+}
+
+void Octree::gaussian_sums(const std::vector<PointAggregate> &aggregates, const std::vector<double> &attributes,
+                           const Vec3 &point, const float *sigmas, const float *radii, size_t num_scales,
+                           double tolerance, GaussianSum *sums) const {
+    assert(num_scales <= 32);
+    double inv_sigma_squared[32];
+    float squared_radius[32];
+    float max_squared_halfsize[32];
+    for (size_t s = 0; s < num_scales; ++s) {
+        sums[s] = GaussianSum();
+        inv_sigma_squared[s] = 1.0 / (static_cast<double>(sigmas[s]) * sigmas[s]);
+        squared_radius[s] = radii[s] * radii[s];
+        max_squared_halfsize[s] = static_cast<float>(tolerance * sigmas[s] * sigmas[s]);
+    }
+    if (storage.empty() || num_scales == 0) return;
+
+    // the stack entries carry the scales that are neither pruned nor approximated at an ancestor
+    struct StackItem {
+        size_t index;
+        AABB aabb;
+        uint32_t scales;
+    };
+    StackItem stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = {0, root_aabb, static_cast<uint32_t>(num_scales == 32 ? ~0u : (1u << num_scales) - 1)};
+    while (stack_size > 0) {
+        const StackItem item = stack[--stack_size];
+        const Node &node = storage[item.index];
+
+        float min_squared, max_squared;
+        box_distances(item.aabb, point, min_squared, max_squared);
+        const float squared_halfsize = item.aabb.halfsize.squared_length();
+
+        uint32_t open_scales = 0;
+        for (size_t s = 0; s < num_scales; ++s) {
+            if (!CHECK_BIT(item.scales, s) || min_squared >= squared_radius[s]) continue;
+            if (max_squared < squared_radius[s] && squared_halfsize <= max_squared_halfsize[s]) {
+                // sum_i a_i w(p_i) ~ w(c) (A - (c - point) . (sum_i a_i p_i - c A) / sigma^2), A = sum_i a_i
+                const PointAggregate &aggregate = aggregates[item.index];
+                const Vec3 c = aggregate.centroid();
+                const Vec3 d = c - point;
+                double w = std::exp(-0.5 * d.squared_length() * inv_sigma_squared[s]);
+                double dipole = 0;
+                for (size_t i = 0; i < 3; ++i) {
+                    dipole += d[i] * (aggregate.attribute_moment[i] - c[i] * aggregate.attribute_sum);
+                }
+                sums[s].weighted_sum += w * (aggregate.attribute_sum - dipole * inv_sigma_squared[s]);
+                sums[s].weight += w * static_cast<double>(aggregate.count);
+                continue;
+            }
+            open_scales |= 1u << s;
+        }
+        if (open_scales == 0) continue;
+
+        if (node.config == 0) {
+            for (size_t i = node.data.start; i < node.data.start + node.data.size; ++i) {
+                size_t idx = indices[i];
+                float squared_dist = (points[idx] - point).squared_length();
+                double attribute = attributes.empty() ? 0.0 : attributes[idx];
+                for (size_t s = 0; s < num_scales; ++s) {
+                    if (!CHECK_BIT(open_scales, s) || squared_dist >= squared_radius[s]) continue;
+                    double w = std::exp(-0.5 * squared_dist * inv_sigma_squared[s]);
+                    sums[s].weighted_sum += w * attribute;
+                    sums[s].weight += w;
+                }
+            }
+            continue;
+        }
+
+        Vec3 child_extent = item.aabb.halfsize / 2;
+        size_t offset = 0;
+        for (uint8_t i = 0; i < 8; ++i) {
+            if (!child_exists(node.config, i)) continue;
+            stack[stack_size++] = {node.first_child_index + offset, child_box(item.aabb, i, child_extent), open_scales};
+            ++offset;
+        }
     }
 }
 
-void
-Octree::query_knn(size_t index, const AABB &aabb, const Vec3 &point, ResultSet &resultSet, size_t depth) const {
-    //descend to leaf
-    //first order children by distance to query point
+uint64_t Octree::locate(const Vec3 &point, size_t depth) const {
+    uint64_t code;
+    point_codes(&point, 1, &code);
+    return uint64_t(1) << (3 * depth) | code >> (3 * (max_depth - depth));
+}
+
+size_t Octree::count_radius(const Vec3 &point, float radius) const {
+    size_t count = 0;
+    visit_radius_nodes(point, radius, 21, [&count](const Node &node) { count += node.data.size; },
+                       [&count](size_t, float) { ++count; });
+    return count;
+}
+
+void Octree::query_knn(const Vec3 &point, int k, ResultSet &resultSet, size_t depth) const {
+    resultSet.reset(static_cast<size_t>(std::max(k, 0)));
+    if (storage.empty() || k <= 0) return;
+
+    // seed the result set with the smallest subtree around the query point that still holds k points (its points
+    // are contiguous in indices), so the search below starts with a finite worst distance and does not have to
+    // queue every sibling on the way down
+    size_t seed = 0;
+    AABB seed_box = root_aabb;
+    while (storage[seed].config != 0 && tree_depth(storage[seed].loc_code) < depth) {
+        const Node &node = storage[seed];
+        uint8_t morton = morton_code(point, seed_box.center);
+        if (!child_exists(node.config, morton)) break;
+        size_t child = node.first_child_index + child_count(node.config & static_cast<uint8_t>(BIT(morton) - 1));
+        if (storage[child].data.size < static_cast<size_t>(k)) break;
+        seed = child;
+        seed_box = child_box(seed_box, morton, seed_box.halfsize / 2);
+    }
+    for (size_t i = storage[seed].data.start; i < storage[seed].data.start + storage[seed].data.size; ++i) {
+        size_t idx = indices[i];
+        float squared_dist = (point - points[idx]).squared_length();
+        if (squared_dist < resultSet.worst_dist * resultSet.worst_dist) {
+            resultSet.add_point(idx, std::sqrt(squared_dist));
+        }
+    }
 
-    const Node &node = storage[index];
-    //collect up to k points
-    if (node.config == 0 || tree_depth(node.loc_code) == depth) {
-        if (node.data.size > 0) {
-            for (size_t i = node.data.start; i <= node.data.end; ++i) {
+    // depth first, closest child first: the children of an expanded node are pushed farthest first, so the
+    // closest one is popped next; a popped node is skipped once it is not closer than the current k-th neighbour
+    using PendingNode = ResultSet::PendingNode;
+    std::vector<PendingNode> &pending = resultSet.pending;
+    pending.push_back({0, 0, root_aabb});
+    while (!pending.empty()) {
+        const PendingNode item = pending.back();
+        pending.pop_back();
+        // max() squares to inf while the set is not full; the seed subtree has been scanned already
+        float worst_squared = resultSet.worst_dist * resultSet.worst_dist;
+        if (item.min_squared >= worst_squared || item.index == seed) continue;
+
+        const Node &node = storage[item.index];
+        if (node.config == 0 || tree_depth(node.loc_code) >= depth) {
+            for (size_t i = node.data.start; i < node.data.start + node.data.size; ++i) {
                 size_t idx = indices[i];
-                resultSet.add_point(idx, (point - points[idx]).length());
+                float squared_dist = (point - points[idx]).squared_length();
+                if (squared_dist < worst_squared) {
+                    resultSet.add_point(idx, std::sqrt(squared_dist));
+                    worst_squared = resultSet.worst_dist * resultSet.worst_dist;
+                }
+            }
+            continue;
+        }
+
+        float min_squared[8], max_squared[8];
+        child_box_distances(item.aabb, point, min_squared, max_squared);
+        uint8_t order[8];
+        size_t child_indices[8];
+        size_t num_children = 0;
+        size_t child_index = node.first_child_index;
+        for (uint8_t i = 0; i < 8; ++i) {
+            if (!child_exists(node.config, i)) continue;
+            if (min_squared[i] < worst_squared) {
+                // insertion sort, farthest first
+                size_t j = num_children++;
+                while (j > 0 && min_squared[order[j - 1]] < min_squared[i]) {
+                    order[j] = order[j - 1];
+                    child_indices[j] = child_indices[j - 1];
+                    --j;
+                }
+                order[j] = i;
+                child_indices[j] = child_index;
             }
-            resultSet.sort();
+            ++child_index;
+        }
+        Vec3 child_extent = item.aabb.halfsize / 2;
+        for (size_t j = 0; j < num_children; ++j) {
+            pending.push_back({min_squared[order[j]], child_indices[j], child_box(item.aabb, order[j], child_extent)});
+        }
+    }
+    pending.clear();
+    resultSet.sort();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void DynamicOctree::clear() {
+    OctreeBase::clear();
+    positions.clear();
+    locations.clear();
+    free_blocks.clear();
+    num_points = 0;
+    updates = 0;
+}
+
+void DynamicOctree::assign(const std::vector<Vec3> &points) {
+    for (const Vec3 &point : points) check_finite(point);
+    clear();
+    positions = points;
+    locations.assign(points.size(), {npos, 0});
+    std::vector<size_t> ids(points.size());
+    for (size_t i = 0; i < ids.size(); ++i) ids[i] = i;
+    build_from(ids);
+}
+
+size_t DynamicOctree::insert(const Vec3 &point) {
+    check_finite(point);
+    size_t id = positions.size();
+    positions.push_back(point);
+    locations.push_back({npos, 0});
+    attach(id);
+    rebalance_if_due();
+    return id;
+}
+
+size_t DynamicOctree::insert(const std::vector<Vec3> &points) {
+    size_t first = positions.size();
+    if (points.empty()) return first;
+    Vec3 min = points[0], max = points[0];
+    for (const Vec3 &point : points) {
+        check_finite(point);
+        for (size_t a = 0; a < 3; ++a) {
+            min[a] = std::min(min[a], point[a]);
+            max[a] = std::max(max[a], point[a]);
+        }
+    }
+    if (storage.empty()) {
+        storage.push_back(Node(0, 1, 0, 0, PointBucket()));
+        root_aabb = dyadic_cube(min, max);
+    } else {
+        grow_root(min);
+        grow_root(max);
+    }
+    positions.insert(positions.end(), points.begin(), points.end());
+    locations.resize(positions.size(), {npos, 0});
+    for (size_t id = first; id < positions.size(); ++id) attach(id);
+    rebalance_if_due();
+    return first;
+}
+
+bool DynamicOctree::remove(size_t id) {
+    if (!contains(id)) return false;
+    detach(id);
+    rebalance_if_due();
+    return true;
+}
+
+void DynamicOctree::move(size_t id, const Vec3 &point) {
+    if (!contains(id)) return;
+    check_finite(point);
+    relocate(id, point);
+    rebalance_if_due();
+}
+
+void DynamicOctree::rebuild() {
+    std::vector<size_t> ids;
+    ids.reserve(num_points);
+    for (size_t id = 0; id < locations.size(); ++id) {
+        if (locations[id].leaf != npos) ids.push_back(id);
+    }
+    OctreeBase::clear();
+    free_blocks.clear();
+    build_from(ids);
+}
+
+size_t DynamicOctree::query_radius(const Vec3 &point, float radius,
+                                   std::vector<std::pair<size_t, float>> &results) const {
+    results.clear();
+    visit_radius(point, radius, [&results](size_t id, float squared_dist) { results.emplace_back(id, squared_dist); });
+    return results.size();
+}
+
+void DynamicOctree::query_knn(const Vec3 &point, int k, ResultSet &resultSet) const {
+    resultSet.reset(static_cast<size_t>(std::max(k, 0)));
+    if (storage.empty() || k <= 0) return;
+
+    using PendingNode = ResultSet::PendingNode;
+    std::vector<PendingNode> &pending = resultSet.pending;
+    const auto farther = [](const PendingNode &lhs, const PendingNode &rhs) {
+        return lhs.min_squared > rhs.min_squared;
+    };
+    pending.push_back({0, 0, root_aabb});
+    while (!pending.empty()) {
+        std::pop_heap(pending.begin(), pending.end(), farther);
+        const PendingNode item = pending.back();
+        pending.pop_back();
+        float worst_squared = resultSet.worst_dist * resultSet.worst_dist;
+        if (item.min_squared >= worst_squared) break;
+
+        const Node &node = storage[item.index];
+        if (node.config == 0) {
+            for (size_t id : node.data.ids) {
+                float squared_dist = (point - positions[id]).squared_length();
+                if (squared_dist < worst_squared) {
+                    resultSet.add_point(id, std::sqrt(squared_dist));
+                    worst_squared = resultSet.worst_dist * resultSet.worst_dist;
+                }
+            }
+            continue;
+        }
+
+        float min_squared[8], max_squared[8];
+        child_box_distances(item.aabb, point, min_squared, max_squared);
+        Vec3 child_extent = item.aabb.halfsize / 2;
+        for (uint8_t i = 0; i < 8; ++i) {
+            size_t child = node.first_child_index + i;
+            if (storage[child].data.count == 0 || min_squared[i] >= worst_squared) continue;
+            pending.push_back({min_squared[i], child, child_box(item.aabb, i, child_extent)});
+            std::push_heap(pending.begin(), pending.end(), farther);
+        }
+    }
+    pending.clear();
+    resultSet.sort();
+}
+
+AABB DynamicOctree::dyadic_cube(const Vec3 &min, const Vec3 &max) {
+    float extent = 0, magnitude = 1;
+    for (size_t a = 0; a < 3; ++a) {
+        extent = std::max(extent, max[a] - min[a]);
+        magnitude = std::max(magnitude, std::max(std::abs(min[a]), std::abs(max[a])));
+    }
+    // a halfsize far below the spacing of the floats around the points would not move the center when the root
+    // grows, so it is at least 2^-20 of their magnitude
+    int exponent;
+    std::frexp(std::max(extent, std::ldexp(magnitude, -20)), &exponent);
+    float halfsize = std::ldexp(1.0f, exponent);
+    // the center is at most halfsize / 2 from the middle of [min, max] and extent <= halfsize
+    Vec3 center;
+    for (size_t a = 0; a < 3; ++a) {
+        center[a] = std::round((0.5f * min[a] + 0.5f * max[a]) / halfsize) * halfsize;
+    }
+    return AABB(center, Vec3(halfsize, halfsize, halfsize));
+}
+
+void DynamicOctree::build_from(const std::vector<size_t> &ids) {
+    num_points = ids.size();
+    updates = 0;
+    node_index.clear();
+    if (ids.empty()) return;
+    Vec3 min = positions[ids[0]], max = positions[ids[0]];
+    for (size_t id : ids) {
+        for (size_t a = 0; a < 3; ++a) {
+            min[a] = std::min(min[a], positions[id][a]);
+            max[a] = std::max(max[a], positions[id][a]);
+        }
+    }
+    root_aabb = dyadic_cube(min, max);
+    storage.push_back(Node(0, 1, 0, 0, PointBucket()));
+    storage[0].data.ids.reserve(ids.size());
+    for (size_t id : ids) put(0, id);
+    split(0, root_aabb);
+}
+
+void DynamicOctree::check_finite(const Vec3 &point) {
+    if (!std::isfinite(point[0]) || !std::isfinite(point[1]) || !std::isfinite(point[2])) {
+        throw std::invalid_argument("DynamicOctree: point is not finite.\n");
+    }
+}
+
+void DynamicOctree::relocate(size_t id, const Vec3 &point) {
+    if (inside(root_aabb, point)) {
+        AABB aabb;
+        if (find_leaf(point, aabb) == locations[id].leaf) {
+            positions[id] = point;
             return;
         }
     }
+    detach(id);
+    positions[id] = point;
+    attach(id);
+}
 
-    uint8_t morton = morton_code(point, aabb.center);
-    Vec3 child_extent = aabb.halfsize / 2;
-    uint8_t offset = 0;
-    for (uint8_t i = 0; i < 8; ++i) {
-        if (morton == i) break;
-        if (!child_exists(node.config, i)) continue;
-        ++offset;
+void DynamicOctree::attach(size_t id) {
+    const Vec3 &point = positions[id];
+    if (storage.empty()) {
+        storage.push_back(Node(0, 1, 0, 0, PointBucket()));
+        root_aabb = dyadic_cube(point, point);
     }
-    if (child_exists(node.config, morton)) {
-        query_knn(node.first_child_index + offset, child_box(aabb, morton, child_extent), point, resultSet, depth);
+    grow_root(point);
+
+    size_t index = 0;
+    AABB aabb = root_aabb;
+    while (storage[index].config != 0) {
+        ++storage[index].data.count;
+        uint8_t octant = morton_code(point, aabb.center);
+        index = storage[index].first_child_index + octant;
+        aabb = child_box(aabb, octant, aabb.halfsize / 2);
     }
+    put(index, id);
+    ++num_points;
+    ++updates;
+    node_index.clear();
+    if (storage[index].data.ids.size() > leaf_size) split(index, aabb);
+}
+
+void DynamicOctree::detach(size_t id) {
+    const PointLocation location = locations[id];
+    PointBucket &bucket = storage[location.leaf].data;
+    size_t last = bucket.ids.back();
+    bucket.ids[location.slot] = last;
+    locations[last].slot = location.slot;
+    bucket.ids.pop_back();
+    --bucket.count;
+    locations[id] = {npos, 0};
+    --num_points;
+    ++updates;
+    node_index.clear();
+
+    // the counts only shrink towards the leaf, so the last ancestor found is the highest one to merge
+    size_t merge = npos;
+    for (size_t index = location.leaf; index != 0;) {
+        index = storage[index].parent_index;
+        if (--storage[index].data.count <= leaf_size / 2) merge = index;
+    }
+    if (merge != npos) collapse(merge);
+}
+
+size_t DynamicOctree::find_leaf(const Vec3 &point, AABB &aabb) const {
+    size_t index = 0;
+    aabb = root_aabb;
+    while (storage[index].config != 0) {
+        uint8_t octant = morton_code(point, aabb.center);
+        index = storage[index].first_child_index + octant;
+        aabb = child_box(aabb, octant, aabb.halfsize / 2);
+    }
+    return index;
+}
 
-    offset = 0;
+size_t DynamicOctree::allocate_children(size_t parent) {
+    size_t first;
+    if (!free_blocks.empty()) {
+        first = free_blocks.back();
+        free_blocks.pop_back();
+    } else {
+        first = storage.size();
+        for (uint8_t i = 0; i < 8; ++i) storage.push_back(Node(0, 0, 0, 0, PointBucket()));
+    }
     for (uint8_t i = 0; i < 8; ++i) {
-        if (!child_exists(node.config, i)) continue;
-        if (morton == i) {
-            ++offset;
+        Node &child = storage[first + i];
+        child.config = 0;
+        child.loc_code = child_loc_code(storage[parent].loc_code, i);
+        child.first_child_index = 0;
+        child.parent_index = parent;
+        child.data = PointBucket();
+    }
+    return first;
+}
+
+void DynamicOctree::free_children(size_t first) {
+    // the config is left alone, collapse still walks the nodes of a freed block
+    for (uint8_t i = 0; i < 8; ++i) storage[first + i].loc_code = 0;
+    free_blocks.push_back(first);
+}
+
+void DynamicOctree::split(size_t leaf, const AABB &aabb) {
+    stack_item_t stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = {leaf, aabb};
+    while (stack_size > 0) {
+        --stack_size;
+        const size_t index = stack[stack_size].first;
+        const AABB box = stack[stack_size].second;
+        if (storage[index].data.ids.size() <= leaf_size || tree_depth(storage[index].loc_code) >= max_depth) {
             continue;
-        };
-        AABB childBox = child_box(aabb, i, child_extent);
+        }
+        size_t first = allocate_children(index);
+        std::vector<size_t> ids;
+        ids.swap(storage[index].data.ids);
+        storage[index].config = 0xff;
+        storage[index].first_child_index = first;
+        for (size_t id : ids) put(first + morton_code(positions[id], box.center), id);
+
+        Vec3 child_extent = box.halfsize / 2;
+        for (uint8_t i = 0; i < 8; ++i) {
+            stack[stack_size++] = {first + i, child_box(box, i, child_extent)};
+        }
+    }
+}
+
+void DynamicOctree::collapse(size_t index) {
+    std::vector<size_t> ids;
+    ids.reserve(storage[index].data.count);
+    size_t stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = index;
+    while (stack_size > 0) {
+        Node &node = storage[stack[--stack_size]];
+        if (node.config == 0) {
+            ids.insert(ids.end(), node.data.ids.begin(), node.data.ids.end());
+            node.data = PointBucket();
+            continue;
+        }
+        for (uint8_t i = 0; i < 8; ++i) stack[stack_size++] = node.first_child_index + i;
+        free_children(node.first_child_index);
+    }
+
+    Node &node = storage[index];
+    node.config = 0;
+    node.first_child_index = 0;
+    node.data.count = 0;
+    for (size_t id : ids) put(index, id);
+}
+
+void DynamicOctree::grow_root(const Vec3 &point) {
+    if (inside(root_aabb, point)) return;
+    while (!inside(root_aabb, point)) {
+        // the old root becomes the child on the far side from the point
+        const float halfsize = root_aabb.halfsize[0];
+        Vec3 center = root_aabb.center;
+        uint8_t octant = 0;
+        for (size_t a = 0; a < 3; ++a) {
+            if (point[a] < root_aabb.center[a]) {
+                octant |= static_cast<uint8_t>(BIT(a));
+                center[a] -= halfsize;
+            } else {
+                center[a] += halfsize;
+            }
+        }
+        Node old_root = std::move(storage[0]);
+        size_t first = allocate_children(0);
+        size_t moved = first + octant;
+        storage[moved].config = old_root.config;
+        storage[moved].first_child_index = old_root.first_child_index;
+        storage[moved].data = std::move(old_root.data);
+        if (storage[moved].config == 0) {
+            for (size_t id : storage[moved].data.ids) locations[id].leaf = moved;
+        } else {
+            for (uint8_t i = 0; i < 8; ++i) storage[storage[moved].first_child_index + i].parent_index = moved;
+        }
+
+        Node &root = storage[0];
+        root.config = 0xff;
+        root.loc_code = 1;
+        root.first_child_index = first;
+        root.parent_index = 0;
+        root.data = PointBucket();
+        root.data.count = storage[moved].data.count;
+        root_aabb = AABB(center, Vec3(2 * halfsize, 2 * halfsize, 2 * halfsize));
+    }
+    // a few points far apart would otherwise sit at the end of a chain of inner nodes
+    if (storage[0].data.count <= leaf_size) collapse(0);
+    refresh_loc_codes();
+}
+
+void DynamicOctree::refresh_loc_codes() {
+    node_index.clear();
+    size_t stack[max_stack_size];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    storage[0].loc_code = 1;
+    while (stack_size > 0) {
+        const size_t index = stack[--stack_size];
+        if (storage[index].config == 0) continue;
+        if (tree_depth(storage[index].loc_code) >= max_depth) {
+            collapse(index);
+            continue;
+        }
+        for (uint8_t i = 0; i < 8; ++i) {
+            size_t child = storage[index].first_child_index + i;
+            storage[child].loc_code = child_loc_code(storage[index].loc_code, i);
+            stack[stack_size++] = child;
+        }
+    }
+}
 
-        if (!resultSet.is_full() || childBox.intersect(point, resultSet.worst_dist)) {
-            query_knn(node.first_child_index + offset, childBox, point, resultSet, depth);
+void DynamicOctree::rebalance_if_due() {
+    if (updates <= num_points + min_rebalance_updates) return;
+    updates = 0;
+    if (num_points == 0) return;
+    const float highest = std::numeric_limits<float>::max();
+    Vec3 min(highest, highest, highest), max = Vec3::Lowest();
+    for (size_t id = 0; id < locations.size(); ++id) {
+        if (locations[id].leaf == npos) continue;
+        for (size_t a = 0; a < 3; ++a) {
+            min[a] = std::min(min[a], positions[id][a]);
+            max[a] = std::max(max[a], positions[id][a]);
         }
-        ++offset;
     }
+    if (root_aabb.halfsize[0] >= 4 * dyadic_cube(min, max).halfsize[0]) rebuild();
 }
 
-//}
\ No newline at end of file
+//}
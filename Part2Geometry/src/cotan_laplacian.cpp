@@ -0,0 +1,168 @@
+#include <cotan_laplacian.h>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+CotanLaplacian::CotanLaplacian(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, std::size_t num_threads)
+	: m_faces(faces), m_num_threads(num_threads), m_masses(Eigen::VectorXd::Zero(num_vertices)),
+	m_half_edge_weights(3 * static_cast<std::size_t>(faces.rows()), 0.0), m_corner_areas(3 * static_cast<std::size_t>(faces.rows()), 0.0)
+{
+	// the pattern of igl::cotmatrix: both directions of every edge and the diagonal
+	std::vector<Eigen::Triplet<double>> triplets;
+	triplets.reserve(6 * static_cast<std::size_t>(faces.rows()) + static_cast<std::size_t>(num_vertices));
+	for (Eigen::Index f = 0; f < faces.rows(); ++f)
+	{
+		for (Eigen::Index k = 0; k < 3; ++k)
+		{
+			const int i = faces(f, k);
+			const int j = faces(f, (k + 1) % 3);
+			triplets.emplace_back(i, j, 0.0);
+			triplets.emplace_back(j, i, 0.0);
+		}
+	}
+	for (Eigen::Index v = 0; v < num_vertices; ++v)
+		triplets.emplace_back(static_cast<int>(v), static_cast<int>(v), 0.0);
+	m_laplacian.resize(num_vertices, num_vertices);
+	m_laplacian.setFromTriplets(triplets.begin(), triplets.end());
+	m_laplacian.makeCompressed();
+
+	// column major: L(row, col) is found among the row indices of column col
+	const auto slot = [this](int row, int col)
+	{
+		const int* first = m_laplacian.innerIndexPtr() + m_laplacian.outerIndexPtr()[col];
+		const int* last = m_laplacian.innerIndexPtr() + m_laplacian.outerIndexPtr()[col + 1];
+		return static_cast<int>(std::lower_bound(first, last, row) - m_laplacian.innerIndexPtr());
+	};
+	m_diagonal_slots.resize(static_cast<std::size_t>(num_vertices));
+	for (Eigen::Index v = 0; v < num_vertices; ++v)
+		m_diagonal_slots[static_cast<std::size_t>(v)] = slot(static_cast<int>(v), static_cast<int>(v));
+
+	// gather lists: counting pass, prefix sum, fill; half-edge h goes into L(i, j) and L(j, i), corner c into its vertex
+	const std::size_t num_half_edges = 3 * static_cast<std::size_t>(faces.rows());
+	std::vector<int> edge_slots(2 * num_half_edges);
+	m_slot_offsets.assign(static_cast<std::size_t>(m_laplacian.nonZeros()) + 1, 0);
+	m_vertex_offsets.assign(static_cast<std::size_t>(num_vertices) + 1, 0);
+	for (std::size_t h = 0; h < num_half_edges; ++h)
+	{
+		const int i = faces(h / 3, h % 3);
+		const int j = faces(h / 3, (h + 1) % 3);
+		edge_slots[2 * h] = slot(i, j);
+		edge_slots[2 * h + 1] = slot(j, i);
+		++m_slot_offsets[static_cast<std::size_t>(edge_slots[2 * h]) + 1];
+		++m_slot_offsets[static_cast<std::size_t>(edge_slots[2 * h + 1]) + 1];
+		++m_vertex_offsets[static_cast<std::size_t>(i) + 1];
+	}
+	std::partial_sum(m_slot_offsets.begin(), m_slot_offsets.end(), m_slot_offsets.begin());
+	std::partial_sum(m_vertex_offsets.begin(), m_vertex_offsets.end(), m_vertex_offsets.begin());
+	m_slot_half_edges.resize(static_cast<std::size_t>(m_slot_offsets.back()));
+	m_vertex_corners.resize(static_cast<std::size_t>(m_vertex_offsets.back()));
+	std::vector<int> slot_cursor(m_slot_offsets.begin(), m_slot_offsets.end() - 1);
+	std::vector<int> vertex_cursor(m_vertex_offsets.begin(), m_vertex_offsets.end() - 1);
+	for (std::size_t h = 0; h < num_half_edges; ++h)
+	{
+		m_slot_half_edges[static_cast<std::size_t>(slot_cursor[static_cast<std::size_t>(edge_slots[2 * h])]++)] = static_cast<int>(h);
+		m_slot_half_edges[static_cast<std::size_t>(slot_cursor[static_cast<std::size_t>(edge_slots[2 * h + 1])]++)] = static_cast<int>(h);
+		m_vertex_corners[static_cast<std::size_t>(vertex_cursor[static_cast<std::size_t>(faces(h / 3, h % 3))]++)] = static_cast<int>(h);
+	}
+}
+
+void CotanLaplacian::assemble(const points_t& vertices)
+{
+	const int num_threads = Parallel::numThreads(m_num_threads);
+
+	// per face: the weights of its half-edges and the areas of its corners
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+	for (Eigen::Index f = 0; f < m_faces.rows(); ++f)
+	{
+		// squared length and length of the edge opposite to every corner
+		double l2[3], l[3];
+		for (Eigen::Index k = 0; k < 3; ++k)
+		{
+			l2[k] = (vertices.row(m_faces(f, (k + 1) % 3)) - vertices.row(m_faces(f, (k + 2) % 3))).squaredNorm();
+			l[k] = std::sqrt(l2[k]);
+		}
+		// Kahan's Heron formula on the sorted lengths, as igl::doublearea
+		double a = l[0], b = l[1], c = l[2];
+		if (a < b) std::swap(a, b);
+		if (b < c) std::swap(b, c);
+		if (a < b) std::swap(a, b);
+		const double double_area = 0.5 * std::sqrt((a + (b + c)) * (c - (a - b)) * (c + (a - b)) * (a + (b - c)));
+
+		double cosines[3];
+		for (Eigen::Index k = 0; k < 3; ++k)
+		{
+			const Eigen::Index k1 = (k + 1) % 3;
+			const Eigen::Index k2 = (k + 2) % 3;
+			// half the cotangent of the angle at corner k, the weight of the opposite half-edge k1 -> k2
+			m_half_edge_weights[static_cast<std::size_t>(3 * f + k1)] = (l2[k1] + l2[k2] - l2[k]) / double_area / 4.0;
+			cosines[k] = (l[k2] * l[k2] + l[k1] * l[k1] - l[k] * l[k]) / (l[k1] * l[k2] * 2.0);
+		}
+
+		// mixed Voronoi areas (igl::massmatrix_intrinsic): circumcentric split of the face, a quarter / half of the
+		// area for the corners of an obtuse triangle
+		double* quads = m_corner_areas.data() + 3 * f;
+		int obtuse = -1;
+		for (int k = 0; k < 3; ++k)
+		{
+			if (cosines[k] < 0)
+				obtuse = k;
+		}
+		if (obtuse >= 0)
+		{
+			for (int k = 0; k < 3; ++k)
+				quads[k] = (k == obtuse ? 0.25 : 0.125) * double_area;
+		}
+		else
+		{
+			double partial[3];
+			const double sum = cosines[0] * l[0] + cosines[1] * l[1] + cosines[2] * l[2];
+			for (int k = 0; k < 3; ++k)
+				partial[k] = cosines[k] * l[k] / sum * double_area * 0.5;
+			for (int k = 0; k < 3; ++k)
+				quads[k] = (partial[(k + 1) % 3] + partial[(k + 2) % 3]) * 0.5;
+		}
+	}
+
+	// gather per column, the diagonal makes the column sum to zero
+	const int* outer = m_laplacian.outerIndexPtr();
+	double* values = m_laplacian.valuePtr();
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(num_threads)
+	for (Eigen::Index col = 0; col < m_laplacian.outerSize(); ++col)
+	{
+		const int diagonal = m_diagonal_slots[static_cast<std::size_t>(col)];
+		double sum = 0.0;
+		for (int n = outer[col]; n < outer[col + 1]; ++n)
+		{
+			if (n == diagonal)
+				continue;
+			double value = 0.0;
+			for (int e = m_slot_offsets[static_cast<std::size_t>(n)]; e < m_slot_offsets[static_cast<std::size_t>(n) + 1]; ++e)
+				value += m_half_edge_weights[static_cast<std::size_t>(m_slot_half_edges[static_cast<std::size_t>(e)])];
+			values[n] = value;
+			sum += value;
+		}
+		values[diagonal] = -sum;
+
+		double area = 0.0;
+		for (int e = m_vertex_offsets[static_cast<std::size_t>(col)]; e < m_vertex_offsets[static_cast<std::size_t>(col) + 1]; ++e)
+			area += m_corner_areas[static_cast<std::size_t>(m_vertex_corners[static_cast<std::size_t>(e)])];
+		m_masses(col) = area;
+	}
+}
+
+void CotanLaplacian::combine(double mass_factor, double laplacian_factor, Eigen::SparseMatrix<double>& A) const
+{
+	setupPattern(A);
+	const double* values = m_laplacian.valuePtr();
+	double* result = A.valuePtr();
+	for (Eigen::Index n = 0; n < m_laplacian.nonZeros(); ++n)
+		result[n] = laplacian_factor * values[n];
+	for (Eigen::Index v = 0; v < m_masses.size(); ++v)
+		result[m_diagonal_slots[static_cast<std::size_t>(v)]] += mass_factor * m_masses(v);
+}
+
+void CotanLaplacian::setupPattern(Eigen::SparseMatrix<double>& A) const
+{
+	if (A.nonZeros() != m_laplacian.nonZeros() || A.rows() != m_laplacian.rows() || !A.isCompressed())
+		A = m_laplacian;
+}
@@ -4,24 +4,140 @@
 #include <igl/opengl/glfw/Viewer.h>
 #include <exception>
 #include <stdexcept>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <parallel.h>
 
-ICPAligner::ICPAligner(const Eigen::MatrixXd & target_points) :
-	m_target_kdtree(nullptr)
+template <typename Scalar>
+ICPAlignerT<Scalar>::ICPAlignerT(const points_type & target_points) :
+	m_target_index(nullptr)
 {
 	buildKDTree(target_points);
 }
 
-double ICPAligner::align(Eigen::Matrix3d & optimal_rotation,
+template <typename Scalar>
+double ICPAlignerT<Scalar>::align(Eigen::Matrix3d & optimal_rotation,
 	Eigen::Vector3d & optimal_translation,
-	Eigen::MatrixXd & query_points,
-	const Eigen::MatrixXd & target_points,
-	const Eigen::MatrixXd & target_normals,
-	const Eigen::MatrixXd & query_normals,
+	points_type & query_points,
+	const points_type & target_points,
+	const points_type & target_normals,
+	const points_type & query_normals,
 	double max_distance,
 	double min_normal_cos_theta,
 	double min_err,
 	double min_err_change,
-	size_t max_iterations)
+	size_t max_iterations,
+	std::size_t num_threads,
+	ICPSolverType solver_type,
+	bool reuse_correspondences,
+	std::size_t anderson_depth)
+{
+	m_num_iterations = 0;
+	m_verbose = true;
+	// query normals have to follow the query points, the plane based solvers and the normal rejection use them
+	points_type current_query_normals(query_normals);
+	return alignLevel(optimal_rotation, optimal_translation, query_points, current_query_normals, target_points, target_normals, *m_target_index->kdtree, max_distance, min_normal_cos_theta, min_err, min_err_change, max_iterations, num_threads, solver_type, reuse_correspondences, anderson_depth);
+}
+
+template <typename Scalar>
+double ICPAlignerT<Scalar>::align(Eigen::Matrix3d & optimal_rotation, Eigen::Vector3d & optimal_translation, points_type & query_points, const points_type & target_points, const points_type & target_normals, const points_type & query_normals, const ICPParams & params)
+{
+	m_num_iterations = 0;
+	m_verbose = params.verbose;
+	if (params.pyramid_levels <= 1)
+	{
+		points_type current_query_normals(query_normals);
+		return alignLevel(optimal_rotation, optimal_translation, query_points, current_query_normals, target_points, target_normals, *m_target_index->kdtree, params.max_distance, params.min_normal_cos_theta, params.min_err, params.min_err_change, params.max_iterations, params.num_threads, params.solver_type, params.reuse_correspondences, params.anderson_depth);
+	}
+
+	optimal_rotation.setIdentity();
+	optimal_translation.setZero();
+	Eigen::Matrix3d level_rotation;
+	Eigen::Vector3d level_translation;
+
+	// voxel size of the first coarse level, every further level doubles it (~1/4 of the surface samples per level)
+	double voxel_size = params.pyramid_voxel_size;
+	if (voxel_size <= 0.0)
+	{
+		double diagonal = static_cast<double>((target_points.colwise().maxCoeff() - target_points.colwise().minCoeff()).norm());
+		voxel_size = 2.0 * diagonal / std::sqrt(static_cast<double>(std::max<Eigen::DenseIndex>(target_points.rows(), 1)));
+	}
+
+	// coarse levels, index 0 is the finest coarse level; the full resolution set is the implicit last level
+	std::size_t num_coarse_levels = params.pyramid_levels - 1;
+	std::vector<ICPPyramidLevel> levels(num_coarse_levels);
+	for (std::size_t l = 0; l < num_coarse_levels; ++l)
+	{
+		double level_voxel_size = voxel_size * std::pow(2.0, static_cast<double>(l));
+		voxelDownsample(target_points, target_normals, level_voxel_size, levels[l].target_points, levels[l].target_normals);
+		voxelDownsample(query_points, query_normals, level_voxel_size, levels[l].query_points, levels[l].query_normals);
+		levels[l].kdtree.reset(new kdtree_t(3, levels[l].target_points));
+		levels[l].kdtree->index->buildIndex();
+	}
+
+	if (!(params.pyramid_max_distance_scale > 0.0))
+		throw std::invalid_argument("ICP: pyramid_max_distance_scale has to be positive.\n");
+
+	// run coarsest to finest; max_distance belongs to the full resolution sets, every coarser level divides it by the scale
+	for (std::size_t l = num_coarse_levels; l-- > 0;)
+	{
+		ICPPyramidLevel& level = levels[l];
+		const double level_max_distance = params.max_distance / std::pow(params.pyramid_max_distance_scale, static_cast<double>(l + 1));
+		if (m_verbose)
+			std::cout << "\nICP: Pyramid level " << l + 1 << " (" << level.query_points.rows() << " query / " << level.target_points.rows() << " target points)\n";
+		if (level.query_points.rows() == 0 || level.target_points.rows() == 0)
+			continue;
+
+		// bring the level into the pose found so far
+		applyRigidTransform(level.query_points, optimal_rotation, optimal_translation, false, params.num_threads);
+		applyRotation(level.query_normals, optimal_rotation, params.num_threads);
+
+		alignLevel(level_rotation, level_translation, level.query_points, level.query_normals, level.target_points, level.target_normals, *level.kdtree, level_max_distance, params.min_normal_cos_theta, params.min_err, params.min_err_change, params.max_iterations, params.num_threads, params.solver_type, params.reuse_correspondences, params.anderson_depth);
+		optimal_rotation = level_rotation * optimal_rotation;
+		optimal_translation = level_rotation * optimal_translation + level_translation;
+	}
+
+	// refine on the full resolution sets
+	if (m_verbose)
+		std::cout << "\nICP: Pyramid level 0 (" << query_points.rows() << " query / " << target_points.rows() << " target points)\n";
+	applyRigidTransform(query_points, optimal_rotation, optimal_translation, false, params.num_threads);
+	points_type current_query_normals(query_normals);
+	applyRotation(current_query_normals, optimal_rotation, params.num_threads);
+	double error = alignLevel(level_rotation, level_translation, query_points, current_query_normals, target_points, target_normals, *m_target_index->kdtree, params.max_distance, params.min_normal_cos_theta, params.min_err, params.min_err_change, params.max_iterations, params.num_threads, params.solver_type, params.reuse_correspondences, params.anderson_depth);
+	optimal_rotation = level_rotation * optimal_rotation;
+	optimal_translation = level_rotation * optimal_translation + level_translation;
+	return error;
+}
+
+template <typename Scalar>
+double ICPAlignerT<Scalar>::align(Eigen::Matrix3d & optimal_rotation, Eigen::Vector3d & optimal_translation, Eigen::MatrixXd & query_points, const Eigen::MatrixXd & target_points, const Eigen::MatrixXd & target_normals, const Eigen::MatrixXd & query_normals, const ICPParams & params)
+{
+	points_type points(toPointMatrix<Scalar>(query_points));
+	double error = align(optimal_rotation, optimal_translation, points, toPointMatrix<Scalar>(target_points), toPointMatrix<Scalar>(target_normals), toPointMatrix<Scalar>(query_normals), params);
+	query_points = points.template cast<double>();
+	return error;
+}
+
+template <typename Scalar>
+double ICPAlignerT<Scalar>::alignLevel(Eigen::Matrix3d & optimal_rotation,
+	Eigen::Vector3d & optimal_translation,
+	points_type & query_points,
+	points_type & query_normals,
+	const points_type & target_points,
+	const points_type & target_normals,
+	const kdtree_t & kdtree,
+	double max_distance,
+	double min_normal_cos_theta,
+	double min_err,
+	double min_err_change,
+	size_t max_iterations,
+	std::size_t num_threads,
+	ICPSolverType solver_type,
+	bool reuse_correspondences,
+	std::size_t anderson_depth)
 {
 	optimal_rotation.setIdentity();
 	optimal_translation.setZero();
@@ -30,57 +146,185 @@ double ICPAligner::align(Eigen::Matrix3d & optimal_rotation,
 	optimal_rotation_delta.setIdentity();
 	optimal_translation_delta.setZero();
 
-	Eigen::MatrixXi correspondences;
-	Eigen::MatrixXd distances;
-	Eigen::VectorXd weights;
+	workspace_type workspace;
+	workspace.reserve(query_points.rows());
+
+	const bool accelerate = anderson_depth > 0;
+	ICPAndersonAccelerator anderson;
+	ICPAndersonAccelerator::vec6_t x = ICPAndersonAccelerator::vec6_t::Zero();
+	ICPAndersonAccelerator::vec6_t g = ICPAndersonAccelerator::vec6_t::Zero();
+	bool accelerated = false;
+	if (accelerate)
+	{
+		anderson.init(anderson_depth);
+		workspace.source_points = query_points;
+		workspace.source_normals = query_normals;
+	}
 
 	double error = std::numeric_limits<double>::max();
 	std::size_t itct = 0;
 	while (true)
 	{
-		std::cout << "\nICP: Iteration " << itct << "\n";
-		std::cout << "ICP: Calculating correspondences...\n";
-		genCorrespondences(correspondences, distances, query_points, target_points, target_normals, query_normals, max_distance, min_normal_cos_theta);
-		std::cout << "ICP: " << correspondences.rows() <<  " correspondences found.\n";
-		if(correspondences.rows() == 0)
-			throw std::logic_error("ICP: No correspondences found.\n");
-		std::cout << "ICP: Calculating error...\n";
-		double newerror = calcMAE(query_points, target_points, correspondences);
-		std::cout << "ICP: Current Error: " << newerror << "\n";
+		if (m_verbose)
+			std::cout << "\nICP: Iteration " << itct << "\nICP: Calculating correspondences...\n";
+		double newerror = calcCorrespondenceError(workspace, query_points, query_normals, target_points, target_normals, kdtree, max_distance, min_normal_cos_theta, num_threads, reuse_correspondences);
+		if (m_verbose)
+			std::cout << "ICP: Current Error: " << newerror << "\n";
+		if (accelerated && newerror > error)
+		{
+			// safeguard: the accelerated step made things worse, continue from the plain ICP step instead
+			if (m_verbose)
+				std::cout << "ICP: Accelerated step rejected, falling back to plain ICP step.\n";
+			x = g;
+			anderson.reset();
+			setPose(query_points, query_normals, workspace, x, optimal_rotation, optimal_translation, num_threads);
+			newerror = calcCorrespondenceError(workspace, query_points, query_normals, target_points, target_normals, kdtree, max_distance, min_normal_cos_theta, num_threads, reuse_correspondences);
+			if (m_verbose)
+				std::cout << "ICP: Current Error: " << newerror << "\n";
+		}
+		m_num_iterations++;
 		if (std::abs(newerror - error) < min_err_change || newerror < min_err)
 		{
-			std::cout << "ICP: Registration finished!\n";
+			if (m_verbose)
+				std::cout << "ICP: Registration finished!\n";
+			m_converged = true;
 			return newerror;
 		}
 		else if (itct > max_iterations)
 		{
-			std::cout << "ICP: Registration failed.\n";
+			if (m_verbose)
+				std::cout << "ICP: Registration failed.\n";
+			m_converged = false;
 			return newerror;
 		}
 		error = newerror;
 		
-		std::cout << "ICP: Aligning correspondences...\n";
-		optimalRigidTransform(query_points, target_points, correspondences, weights, optimal_rotation_delta, optimal_translation_delta);
-		std::cout << "ICP: Transforming query set...\n";
-		applyRigidTransform(query_points, optimal_rotation_delta, optimal_translation_delta);
-		// update global transformation
-		optimal_rotation = optimal_rotation_delta * optimal_rotation;
-		optimal_translation = optimal_rotation_delta * optimal_translation + optimal_translation_delta;
+		if (m_verbose)
+			std::cout << "ICP: Aligning correspondences...\n";
+		if (solver_type == ICPSolverType::POINT_TO_POINT)
+			optimalRigidTransform(workspace, optimal_rotation_delta, optimal_translation_delta);
+		else
+			optimalRigidTransformPointToPlane(workspace, query_points, target_points, query_normals, target_normals, solver_type == ICPSolverType::SYMMETRIC_POINT_TO_PLANE, optimal_rotation_delta, optimal_translation_delta);
+		if (m_verbose)
+			std::cout << "ICP: Transforming query set...\n";
+		if (accelerate)
+		{
+			// plain ICP update of the accumulated transform, then extrapolate from the history
+			g = toTwist(optimal_rotation_delta * optimal_rotation, optimal_rotation_delta * optimal_translation + optimal_translation_delta);
+			x = anderson.compute(x, g, accelerated);
+			setPose(query_points, query_normals, workspace, x, optimal_rotation, optimal_translation, num_threads);
+		}
+		else
+		{
+			applyRigidTransform(query_points, optimal_rotation_delta, optimal_translation_delta, false, num_threads);
+			applyRotation(query_normals, optimal_rotation_delta, num_threads);
+			// update global transformation
+			optimal_rotation = optimal_rotation_delta * optimal_rotation;
+			optimal_translation = optimal_rotation_delta * optimal_translation + optimal_translation_delta;
+		}
 		itct++;		
 	}
 }
 
-double ICPAligner::align(Eigen::Matrix3d & optimal_rotation, Eigen::Vector3d & optimal_translation, Eigen::MatrixXd & query_points, const Eigen::MatrixXd & target_points, const Eigen::MatrixXd & target_normals, const Eigen::MatrixXd & query_normals, const ICPParams & params)
+template <typename Scalar>
+double ICPAlignerT<Scalar>::calcCorrespondenceError(workspace_type & workspace, const points_type & query_points, const points_type & query_normals, const points_type & target_points, const points_type & target_normals, const kdtree_t & kdtree, double max_distance, double min_normal_cos_theta, std::size_t num_threads, bool reuse_correspondences)
 {
-	return align(optimal_rotation, optimal_translation, query_points, target_points, target_normals, query_normals, params.max_distance, params.min_normal_cos_theta, params.min_err, params.min_err_change, params.max_iterations);
+	genCorrespondences(workspace, query_points, target_normals, query_normals, kdtree, max_distance, min_normal_cos_theta, num_threads, reuse_correspondences);
+	if (m_verbose)
+		std::cout << "ICP: " << workspace.num_correspondences <<  " correspondences found.\n";
+	if (m_verbose && reuse_correspondences)
+		std::cout << "ICP: " << workspace.num_skipped_queries << " of " << query_points.rows() << " kd-tree queries skipped (ratio " << static_cast<double>(workspace.num_skipped_queries) / static_cast<double>(std::max<Eigen::DenseIndex>(query_points.rows(), 1)) << ").\n";
+	if(workspace.num_correspondences == 0)
+		throw std::logic_error("ICP: No correspondences found.\n");
+	if (m_verbose)
+		std::cout << "ICP: Calculating error...\n";
+	calcCorrespondenceStatistics(workspace, query_points, target_points);
+	return workspace.error;
 }
 
-void ICPAligner::setTargetPoints(const Eigen::MatrixXd & target_points)
+template <typename Scalar>
+ICPAndersonAccelerator::vec6_t ICPAlignerT<Scalar>::toTwist(const Eigen::Matrix3d & rotation, const Eigen::Vector3d & translation)
+{
+	Eigen::AngleAxisd aa(rotation);
+	ICPAndersonAccelerator::vec6_t x;
+	x.head<3>() = aa.angle() * aa.axis();
+	x.tail<3>() = translation;
+	return x;
+}
+
+template <typename Scalar>
+void ICPAlignerT<Scalar>::setPose(points_type & query_points, points_type & query_normals, const workspace_type & workspace, const ICPAndersonAccelerator::vec6_t & x, Eigen::Matrix3d & rotation, Eigen::Vector3d & translation, std::size_t num_threads)
+{
+	Eigen::Vector3d w = x.head<3>();
+	double angle = w.norm();
+	rotation = angle > 0.0 ? Eigen::AngleAxisd(angle, w / angle).toRotationMatrix() : Eigen::Matrix3d::Identity();
+	translation = x.tail<3>();
+	// transform the level's source sets into the query buffers, no temporaries
+	const int nthreads = Parallel::numThreads(num_threads);
+#pragma omp parallel for schedule(static) num_threads(nthreads)
+	for (Eigen::DenseIndex i = 0; i < query_points.rows(); ++i)
+	{
+		Eigen::Vector3d p = rotation * workspace.source_points.row(i).transpose().template cast<double>() + translation;
+		Eigen::Vector3d n = rotation * workspace.source_normals.row(i).transpose().template cast<double>();
+		query_points.row(i) = p.transpose().template cast<Scalar>();
+		query_normals.row(i) = n.transpose().template cast<Scalar>();
+	}
+}
+
+template <typename Scalar>
+void ICPAlignerT<Scalar>::voxelDownsample(const points_type & points, const points_type & normals, double voxel_size, points_type & out_points, points_type & out_normals)
+{
+	// one output point per occupied voxel: centroid of the points and normalized mean of the normals inside
+	Eigen::RowVector3d min_corner = points.colwise().minCoeff().template cast<double>();
+	// the voxel keys pack 21 bits per axis
+	const double max_cells = static_cast<double>(1 << 21);
+	if (points.rows() > 0 && !(((points.colwise().maxCoeff().template cast<double>() - min_corner) / voxel_size).maxCoeff() < max_cells))
+		throw std::invalid_argument("ICP: Voxel size too small for the extent of the point set, at most 2^21 voxels per axis.\n");
+	std::unordered_map<std::uint64_t, Eigen::DenseIndex> voxel_index;
+	voxel_index.reserve(static_cast<std::size_t>(points.rows()));
+	std::vector<Eigen::DenseIndex> point_voxel(static_cast<std::size_t>(points.rows()));
+	for (Eigen::DenseIndex i = 0; i < points.rows(); ++i)
+	{
+		Eigen::RowVector3d cell = ((points.row(i).template cast<double>() - min_corner) / voxel_size).array().floor();
+		// 21 bits per axis
+		std::uint64_t key = (static_cast<std::uint64_t>(cell(0)) & 0x1FFFFF)
+			| ((static_cast<std::uint64_t>(cell(1)) & 0x1FFFFF) << 21)
+			| ((static_cast<std::uint64_t>(cell(2)) & 0x1FFFFF) << 42);
+		auto it = voxel_index.emplace(key, static_cast<Eigen::DenseIndex>(voxel_index.size())).first;
+		point_voxel[static_cast<std::size_t>(i)] = it->second;
+	}
+
+	// sums in double, a float voxel may hold many points
+	Eigen::DenseIndex num_voxels = static_cast<Eigen::DenseIndex>(voxel_index.size());
+	PointMatrix<double> point_sums = PointMatrix<double>::Zero(num_voxels, 3);
+	PointMatrix<double> normal_sums = PointMatrix<double>::Zero(num_voxels, 3);
+	Eigen::VectorXd counts = Eigen::VectorXd::Zero(num_voxels);
+	for (Eigen::DenseIndex i = 0; i < points.rows(); ++i)
+	{
+		Eigen::DenseIndex v = point_voxel[static_cast<std::size_t>(i)];
+		point_sums.row(v) += points.row(i).template cast<double>();
+		normal_sums.row(v) += normals.row(i).template cast<double>();
+		counts(v) += 1.0;
+	}
+	point_sums.array().colwise() /= counts.array();
+	for (Eigen::DenseIndex v = 0; v < num_voxels; ++v)
+	{
+		double len = normal_sums.row(v).norm();
+		if (len > 0.0)
+			normal_sums.row(v) /= len;
+	}
+	out_points = point_sums.template cast<Scalar>();
+	out_normals = normal_sums.template cast<Scalar>();
+}
+
+template <typename Scalar>
+void ICPAlignerT<Scalar>::setTargetPoints(const points_type & target_points)
 {
 	buildKDTree(target_points);
 }
 
-void ICPAligner::applyRigidTransform(Eigen::MatrixXd & points, const Eigen::Matrix3d & optimal_rotation, const Eigen::Vector3d & optimal_translation, bool reorthonormalize_rotation)
+template <typename Scalar>
+void ICPAlignerT<Scalar>::applyRigidTransform(points_type & points, const Eigen::Matrix3d & optimal_rotation, const Eigen::Vector3d & optimal_translation, bool reorthonormalize_rotation, std::size_t num_threads)
 {
 	//// re-orthonormalize rotation matrix
 	//Eigen::Matrix3d R(optimal_rotation);
@@ -92,86 +336,274 @@ void ICPAligner::applyRigidTransform(Eigen::MatrixXd & points, const Eigen::Matr
 	//	R = svd.matrixU() * F * svd.matrixV().transpose();
 	//}
 
-	points *= optimal_rotation.transpose();
-	points.rowwise() += optimal_translation.transpose();
+	// row by row in place, a full matrix product would need a temporary for the aliased result
+	const int nthreads = Parallel::numThreads(num_threads);
+#pragma omp parallel for schedule(static) num_threads(nthreads)
+	for (Eigen::DenseIndex i = 0; i < points.rows(); ++i)
+	{
+		Eigen::Vector3d p = optimal_rotation * points.row(i).transpose().template cast<double>() + optimal_translation;
+		points.row(i) = p.transpose().template cast<Scalar>();
+	}
 }
 
-void ICPAligner::buildKDTree(const Eigen::MatrixXd& points)
+template <typename Scalar>
+void ICPAlignerT<Scalar>::applyRigidTransform(Eigen::MatrixXd & points, const Eigen::Matrix3d & optimal_rotation, const Eigen::Vector3d & optimal_translation)
 {
-	m_target_kdtree.reset(new kdtree_t(3, points));
-	m_target_kdtree->index->buildIndex();
+	points = (points * optimal_rotation.transpose()).rowwise() + optimal_translation.transpose();
+}
+
+template <typename Scalar>
+void ICPAlignerT<Scalar>::applyRotation(points_type & normals, const Eigen::Matrix3d & rotation, std::size_t num_threads)
+{
+	const int nthreads = Parallel::numThreads(num_threads);
+#pragma omp parallel for schedule(static) num_threads(nthreads)
+	for (Eigen::DenseIndex i = 0; i < normals.rows(); ++i)
+	{
+		Eigen::Vector3d n = rotation * normals.row(i).transpose().template cast<double>();
+		normals.row(i) = n.transpose().template cast<Scalar>();
+	}
 }
 
-double ICPAligner::calcMAE(const Eigen::MatrixXd & a, const Eigen::MatrixXd & b)
+template <typename Scalar>
+void ICPAlignerT<Scalar>::buildKDTree(const points_type& points)
 {
-	return (a - b).rowwise().norm().mean();
+	// build a new index instead of modifying the current one, copies of this aligner may still use it
+	std::shared_ptr<TargetIndex> index = std::make_shared<TargetIndex>();
+	index->points = points;
+	index->kdtree.reset(new kdtree_t(3, index->points));
+	index->kdtree->index->buildIndex();
+	m_target_index = index;
 }
 
-double ICPAligner::calcMAE(const Eigen::MatrixXd & a, const Eigen::MatrixXd & b, const Eigen::MatrixXi & correspondences)
+template <typename Scalar>
+double ICPAlignerT<Scalar>::calcMAE(const points_type & a, const points_type & b)
 {
-	return (a(correspondences.col(0).array(), Eigen::all) - b(correspondences.col(1).array(), Eigen::all)).rowwise().norm().mean();
+	return (a - b).template cast<double>().rowwise().norm().mean();
 }
 
-void ICPAligner::calcWeights(Eigen::VectorXd & weights, const Eigen::MatrixXd & distances)
+template <typename Scalar>
+void ICPAlignerT<Scalar>::calcCorrespondenceStatistics(workspace_type & workspace, const points_type & query_points, const points_type & target_points)
+{
+	// means, cross-covariance and mean error of the pairs in one pass, without gathering the paired rows;
+	// the sums are taken relative to the first pair to keep the cancellation in H small
+	const Eigen::MatrixXi& correspondences = workspace.correspondences;
+	const Eigen::DenseIndex n = workspace.num_correspondences;
+	Eigen::Vector3d q_ref = query_points.row(correspondences(0, 0)).transpose().template cast<double>();
+	Eigen::Vector3d t_ref = target_points.row(correspondences(0, 1)).transpose().template cast<double>();
+	Eigen::Vector3d q_sum = Eigen::Vector3d::Zero();
+	Eigen::Vector3d t_sum = Eigen::Vector3d::Zero();
+	Eigen::Matrix3d qt_sum = Eigen::Matrix3d::Zero();
+	double error_sum = 0.0;
+	for (Eigen::DenseIndex i = 0; i < n; ++i)
+	{
+		Eigen::Vector3d q = query_points.row(correspondences(i, 0)).transpose().template cast<double>();
+		Eigen::Vector3d t = target_points.row(correspondences(i, 1)).transpose().template cast<double>();
+		error_sum += (q - t).norm();
+		q -= q_ref;
+		t -= t_ref;
+		q_sum += q;
+		t_sum += t;
+		qt_sum.noalias() += q * t.transpose();
+	}
+	double inv_n = 1.0 / static_cast<double>(n);
+	workspace.query_mean = q_ref + q_sum * inv_n;
+	workspace.target_mean = t_ref + t_sum * inv_n;
+	workspace.cross_covariance = qt_sum - q_sum * t_sum.transpose() * inv_n;
+	workspace.error = error_sum * inv_n;
+}
+
+template <typename Scalar>
+void ICPAlignerT<Scalar>::calcWeights(Eigen::VectorXd & weights, const Eigen::MatrixXd & distances)
 {
 	weights.resize(distances.rows(), 1);
 	weights = (-(distances.col(0).array() * distances.col(0).array())).exp() * (distances.col(1).array()).max(0.0);
 }
 
-void ICPAligner::optimalRigidTransform(const Eigen::MatrixXd & query_points, const Eigen::MatrixXd & target_points, const Eigen::MatrixXi & correspondences, const Eigen::VectorXd & weights, Eigen::Matrix3d& optimal_rotation, Eigen::Vector3d& optimal_translation)
+template <typename Scalar>
+void ICPAlignerT<Scalar>::optimalRigidTransform(const workspace_type & workspace, Eigen::Matrix3d& optimal_rotation, Eigen::Vector3d& optimal_translation)
 {
-	if (correspondences.rows() >= 2)
+	if (workspace.num_correspondences >= 2)
 	{
-		auto Q = query_points(correspondences.col(0).array(), Eigen::all);
-		auto T = target_points(correspondences.col(1).array(), Eigen::all);
-		Eigen::RowVector3d Q_mean = Q.colwise().mean();
-		Eigen::RowVector3d T_mean = T.colwise().mean();
-		Eigen::Matrix3d H = (Q.rowwise() - Q_mean).transpose() * (T.rowwise() - T_mean);
+		const Eigen::Matrix3d& H = workspace.cross_covariance;
 		Eigen::JacobiSVD<Eigen::Matrix3d> svd(H, Eigen::ComputeFullU | Eigen::ComputeFullV);
-		Eigen::Matrix3d F = Eigen::MatrixXd::Identity(3, 3);
+		Eigen::Matrix3d F = Eigen::Matrix3d::Identity();
 		F(2, 2) = (svd.matrixV() * svd.matrixU().transpose()).determinant();
 		Eigen::Matrix3d R = svd.matrixV() /* F*/ * svd.matrixU().transpose();
-		Eigen::RowVector3d t = T_mean - (Q_mean * R.transpose());
 		optimal_rotation = R;
-		optimal_translation = t.transpose();
+		optimal_translation = workspace.target_mean - R * workspace.query_mean;
 	}
 }
 
-void ICPAligner::genCorrespondences(Eigen::MatrixXi& correspondences,
-	Eigen::MatrixXd& distances,
-	const Eigen::MatrixXd & query_points,
-	const Eigen::MatrixXd & target_points, 
-	const Eigen::MatrixXd & target_normals, 
-	const Eigen::MatrixXd & query_normals, 
+template <typename Scalar>
+void ICPAlignerT<Scalar>::optimalRigidTransformPointToPlane(const workspace_type & workspace, const points_type & query_points, const points_type & target_points, const points_type & query_normals, const points_type & target_normals, bool symmetric, Eigen::Matrix3d & optimal_rotation, Eigen::Vector3d & optimal_translation)
+{
+	// 6 unknowns (rotation vector a, translation t), each pair contributes one plane constraint
+	const Eigen::MatrixXi& correspondences = workspace.correspondences;
+	if (workspace.num_correspondences < 6)
+		return;
+
+	// center the pairs for a better conditioned system
+	Eigen::Vector3d center = 0.5 * (workspace.query_mean + workspace.target_mean);
+
+	// accumulate normal equations of the linearized residuals
+	// point-to-plane:     (q - p).n + a.(q x n)       + t.n,  n = n_p
+	// symmetric:          (q - p).n + a.((q + p) x n) + t.n,  n = n_p + n_q
+	Eigen::Matrix<double, 6, 6> ATA = Eigen::Matrix<double, 6, 6>::Zero();
+	Eigen::Matrix<double, 6, 1> ATb = Eigen::Matrix<double, 6, 1>::Zero();
+	Eigen::Matrix<double, 6, 1> row;
+	for (Eigen::DenseIndex i = 0; i < workspace.num_correspondences; ++i)
+	{
+		Eigen::Vector3d q = query_points.row(correspondences(i, 0)).transpose().template cast<double>() - center;
+		Eigen::Vector3d p = target_points.row(correspondences(i, 1)).transpose().template cast<double>() - center;
+		Eigen::Vector3d n = target_normals.row(correspondences(i, 1)).transpose().template cast<double>();
+		if (symmetric)
+			n += query_normals.row(correspondences(i, 0)).transpose().template cast<double>();
+		row.head<3>() = (symmetric ? Eigen::Vector3d(q + p) : q).cross(n);
+		row.tail<3>() = n;
+		ATA.selfadjointView<Eigen::Lower>().rankUpdate(row);
+		ATb += row * (p - q).dot(n);
+	}
+	Eigen::Matrix<double, 6, 1> x = ATA.selfadjointView<Eigen::Lower>().ldlt().solve(ATb);
+
+	Eigen::Vector3d a = x.head<3>();
+	Eigen::Vector3d t = x.tail<3>();
+	double angle = a.norm();
+	Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+	if (angle > 0.0)
+		R = Eigen::AngleAxisd(angle, a / angle).toRotationMatrix();
+
+	if (symmetric)
+	{
+		// the symmetric objective rotates query and target by half the angle in opposite directions:
+		// R_h q + t = R_h^T p  <=>  p = R_h R_h q + R_h t
+		t = R * t;
+		R = R * R;
+	}
+
+	// undo centering: p = R (q - c) + t + c
+	optimal_rotation = R;
+	optimal_translation = t + center - R * center;
+}
+
+template <typename Scalar>
+void ICPAlignerT<Scalar>::genCorrespondences(workspace_type & workspace,
+	const points_type & query_points,
+	const points_type & target_normals, 
+	const points_type & query_normals, 
+	const kdtree_t & kdtree,
 	double max_distance, 
-	double min_normal_cos_theta)
-{
-	static std::vector<Eigen::RowVector2i> corr_cache(query_points.rows());
-	//static std::vector<Eigen::RowVector2d> dist_cache(query_points.rows());
-	corr_cache.clear();
-	//dist_cache.clear();
-
-	for (Eigen::DenseIndex q = 0; q < query_points.rows(); ++q)
-	{
-		double qp[] = { query_points(q, 0), query_points(q, 1), query_points(q, 2) };
-		Eigen::DenseIndex nnidx;
-		double distance;
-		m_target_kdtree->query(&qp[0], 1, &nnidx, &distance);
-		distance = std::sqrt(distance);
-		double costheta = query_normals.row(q).dot(target_normals.row(nnidx));
-		if (distance <= max_distance && costheta >= min_normal_cos_theta)
+	double min_normal_cos_theta,
+	std::size_t num_threads,
+	bool reuse_correspondences)
+{
+	const int nthreads = Parallel::numThreads(num_threads);
+	const Eigen::DenseIndex num_queries = query_points.rows();
+	const points_type& tree_points = kdtree.m_data_matrix.get();
+	Eigen::VectorXi& nearest = workspace.nearest;
+	Eigen::VectorXd& nearest_distance = workspace.nearest_distance;
+	const bool use_cache = reuse_correspondences && workspace.has_cached_neighbours;
+	Eigen::DenseIndex num_skipped = 0;
+
+	// every query writes only its own slot, so the threads need no merging
+#pragma omp parallel for schedule(static) num_threads(nthreads) reduction(+:num_skipped)
+	for (Eigen::DenseIndex q = 0; q < num_queries; ++q)
+	{
+		// a point that moved by m since its last query is at most d1 + m away from its old neighbour and
+		// at least d2 - m away from every other target point, so the neighbour is unchanged while 2m < d2 - d1
+		if (use_cache && 2.0 * static_cast<double>((query_points.row(q) - workspace.anchor_points.row(q)).norm()) < workspace.anchor_second_distance(q) - workspace.anchor_nearest_distance(q))
+		{
+			nearest_distance(q) = static_cast<double>((query_points.row(q) - tree_points.row(nearest(q))).norm());
+			++num_skipped;
+		}
+		else
 		{
-			corr_cache.push_back(Eigen::RowVector2i{ q, nnidx });
-			//dist_cache.push_back(Eigen::Vector2d{ distance, costheta });
+			Eigen::DenseIndex nnidcs[2];
+			Scalar distances[2] = { std::numeric_limits<Scalar>::max(), std::numeric_limits<Scalar>::max() };
+			// the second neighbour is only needed for the skip test of later iterations; rows are contiguous
+			kdtree.query(query_points.row(q).data(), reuse_correspondences ? 2 : 1, &nnidcs[0], &distances[0]);
+			nearest(q) = static_cast<int>(nnidcs[0]);
+			nearest_distance(q) = std::sqrt(static_cast<double>(distances[0]));
+			if (reuse_correspondences)
+			{
+				workspace.anchor_points.row(q) = query_points.row(q);
+				workspace.anchor_nearest_distance(q) = nearest_distance(q);
+				workspace.anchor_second_distance(q) = std::sqrt(static_cast<double>(distances[1]));
+			}
 		}
+		double costheta = static_cast<double>(query_normals.row(q).dot(target_normals.row(nearest(q))));
+		workspace.accepted(q) = nearest_distance(q) <= max_distance && costheta >= min_normal_cos_theta;
+	}
+	workspace.has_cached_neighbours = reuse_correspondences;
+	workspace.num_skipped_queries = num_skipped;
+
+	// compact the accepted pairs in query order
+	Eigen::DenseIndex row = 0;
+	for (Eigen::DenseIndex q = 0; q < num_queries; ++q)
+	{
+		if (!workspace.accepted(q))
+			continue;
+		workspace.correspondences(row, 0) = static_cast<int>(q);
+		workspace.correspondences(row, 1) = nearest(q);
+		++row;
 	}
+	workspace.num_correspondences = row;
+}
 
-	correspondences.resize(corr_cache.size(), 2);
-	//distances.resize(dist_cache.size(), 2);
+void ICPAndersonAccelerator::init(std::size_t depth)
+{
+	m_depth = static_cast<int>(std::min<std::size_t>(depth, max_depth));
+	m_delta_g.resize(6, m_depth);
+	m_delta_f.resize(6, m_depth);
+	reset();
+}
 
-	for (std::size_t i = 0; i < corr_cache.size(); ++i)
+void ICPAndersonAccelerator::reset()
+{
+	m_count = 0;
+	m_next = 0;
+	m_has_prev = false;
+}
+
+ICPAndersonAccelerator::vec6_t ICPAndersonAccelerator::compute(const vec6_t & x, const vec6_t & g, bool & accelerated)
+{
+	vec6_t f = g - x;
+	if (m_has_prev)
 	{
-		correspondences.row(static_cast<Eigen::DenseIndex>(i)) = corr_cache[i];
-		//distances.row(static_cast<Eigen::DenseIndex>(i)) = dist_cache[i];
+		// ring buffer of the latest differences, the column order does not matter for the least squares fit
+		m_delta_g.col(m_next) = g - m_prev_g;
+		m_delta_f.col(m_next) = f - m_prev_f;
+		m_next = (m_next + 1) % m_depth;
+		m_count = std::min(m_count + 1, m_depth);
 	}
+	m_prev_g = g;
+	m_prev_f = f;
+	m_has_prev = true;
+
+	accelerated = m_count > 0;
+	if (!accelerated)
+		return g;
+
+	// theta = argmin |f - dF theta|, x_next = g - dG theta
+	Eigen::Matrix<double, Eigen::Dynamic, 1, Eigen::ColMajor, max_depth, 1> theta = m_delta_f.leftCols(m_count).colPivHouseholderQr().solve(f);
+	return g - m_delta_g.leftCols(m_count) * theta;
+}
+
+template <typename Scalar>
+void ICPWorkspace<Scalar>::reserve(Eigen::DenseIndex num_query_points)
+{
+	nearest.resize(num_query_points);
+	nearest_distance.resize(num_query_points);
+	accepted.resize(num_query_points);
+	anchor_points.resize(num_query_points, 3);
+	anchor_nearest_distance.resize(num_query_points);
+	anchor_second_distance.resize(num_query_points);
+	correspondences.resize(num_query_points, 2);
+	num_correspondences = 0;
+	has_cached_neighbours = false;
+	num_skipped_queries = 0;
 }
+
+template struct ICPWorkspace<double>;
+template struct ICPWorkspace<float>;
+template class ICPAlignerT<double>;
+template class ICPAlignerT<float>;
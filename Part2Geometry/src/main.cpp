@@ -78,12 +78,15 @@ int main(int argc, char* argv[])
 				1.0,	// w
 				1.0,	// cvtr weight high
 				0.001, // cvtr weight low
-				0.1		// neg. cvtr threshold
+				0.1,	// neg. cvtr threshold
+				HarmonicFieldSolver::Method::AUTOMATIC // linear solver
 			},
 			ToothSegmentation::MeanCurvatureParams{
 				0.00025, // smoothing step size
 				50, // smoothing steps
-				2.0 // max zscore
+				2.0, // max zscore
+				ToothSegmentation::SmoothingScheme::EXPLICIT, // smoothing scheme
+				1 // implicit steps
 			},
 			ToothSegmentation::ToothMeshExtractionParams{
 				0.25, // even tooth threshold
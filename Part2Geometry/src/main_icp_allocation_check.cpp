@@ -0,0 +1,139 @@
+// heap allocation check of the ICP iteration loop: align() sizes its buffers once per call, the iterations have to run
+// without touching the heap. Every allocation is counted (malloc on glibc, which also sees Eigen's buffers, otherwise
+// operator new), the steady state cost is the difference between a run of 2n and one of n iterations. Checked for
+// every solver, with and without correspondence reuse and Anderson acceleration, in both scalar types.
+// Exits with 1 if an iteration allocates.
+//
+//      IcpAllocationCheck [num_points] [num_iterations]
+#include <iostream>
+#include <random>
+#include <string>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <Eigen/Geometry>
+#include <icp.h>
+
+static std::atomic<std::size_t> g_num_allocations(0);
+
+#if defined(__GLIBC__)
+// glibc lets a program replace malloc and friends, forward to its own allocator
+extern "C" void* __libc_malloc(std::size_t size);
+extern "C" void* __libc_calloc(std::size_t count, std::size_t size);
+extern "C" void* __libc_realloc(void* ptr, std::size_t size);
+extern "C" void __libc_free(void* ptr);
+
+extern "C" void* malloc(std::size_t size)
+{
+	++g_num_allocations;
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(std::size_t count, std::size_t size)
+{
+	++g_num_allocations;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, std::size_t size)
+{
+	++g_num_allocations;
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+#else
+void* operator new(std::size_t size)
+{
+	++g_num_allocations;
+	void* ptr = std::malloc(size > 0 ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+#endif
+
+// allocations of one align() call running exactly num_iterations iterations
+template <typename Scalar>
+static std::size_t countAllocations(const PointMatrix<Scalar>& target_points, const PointMatrix<Scalar>& target_normals, ICPParams params, std::size_t num_iterations)
+{
+	PointMatrix<Scalar> query_points(target_points);
+	Eigen::Matrix3d rotation = Eigen::AngleAxisd(0.05, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+	ICPAlignerT<Scalar>::applyRigidTransform(query_points, rotation, Eigen::Vector3d(0.01, -0.02, 0.0));
+	ICPAlignerT<Scalar> icp(target_points);
+
+	// negative thresholds never stop the loop, it runs until max_iterations
+	params.min_err = -1.0;
+	params.min_err_change = -1.0;
+	params.max_iterations = num_iterations;
+	Eigen::Matrix3d optimal_rotation;
+	Eigen::Vector3d optimal_translation;
+	const std::size_t before = g_num_allocations;
+	icp.align(optimal_rotation, optimal_translation, query_points, target_points, target_normals, target_normals, params);
+	return g_num_allocations - before;
+}
+
+template <typename Scalar>
+static std::size_t checkScalar(const std::string& name, const points_t& points, const points_t& normals, std::size_t num_iterations)
+{
+	const PointMatrix<Scalar> target_points = points.cast<Scalar>();
+	const PointMatrix<Scalar> target_normals = normals.cast<Scalar>();
+	const ICPSolverType solvers[] = { ICPSolverType::POINT_TO_POINT, ICPSolverType::POINT_TO_PLANE, ICPSolverType::SYMMETRIC_POINT_TO_PLANE };
+	const char* solver_names[] = { "point to point", "point to plane", "symmetric point to plane" };
+
+	std::size_t failures = 0;
+	for (std::size_t s = 0; s < 3; ++s)
+	{
+		for (std::size_t variant = 0; variant < 3; ++variant)
+		{
+			ICPParams params;
+			params.verbose = false;
+			params.solver_type = solvers[s];
+			params.reuse_correspondences = variant != 1;
+			params.anderson_depth = variant == 2 ? 5 : 0;
+			// the first call also pays for the OpenMP thread pool
+			countAllocations<Scalar>(target_points, target_normals, params, num_iterations);
+			const std::size_t short_run = countAllocations<Scalar>(target_points, target_normals, params, num_iterations);
+			const std::size_t long_run = countAllocations<Scalar>(target_points, target_normals, params, 2 * num_iterations);
+			const std::size_t steady = long_run > short_run ? long_run - short_run : 0;
+			std::cout << name << ", " << solver_names[s] << (variant == 1 ? ", no reuse" : "") << (variant == 2 ? ", anderson" : "")
+				<< ": " << short_run << " allocations per call, " << steady << " in " << num_iterations << " steady state iterations\n";
+			if (steady > 0)
+				++failures;
+		}
+	}
+	return failures;
+}
+
+int main(int argc, char** argv)
+{
+	const std::size_t num_points = argc > 1 ? std::stoul(argv[1]) : 5000;
+	const std::size_t num_iterations = argc > 2 ? std::stoul(argv[2]) : 20;
+
+	// a wavy sheet, the normals follow the height field
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+	points_t points(num_points, 3);
+	points_t normals(num_points, 3);
+	for (std::size_t i = 0; i < num_points; ++i)
+	{
+		const double x = uniform(rng);
+		const double y = uniform(rng);
+		const Eigen::DenseIndex r = static_cast<Eigen::DenseIndex>(i);
+		points.row(r) << x, y, 0.1 * std::sin(3.0 * x) * std::cos(2.0 * y);
+		normals.row(r) = Eigen::RowVector3d(-0.3 * std::cos(3.0 * x) * std::cos(2.0 * y), 0.2 * std::sin(3.0 * x) * std::sin(2.0 * y), 1.0).normalized();
+	}
+
+	std::size_t failures = 0;
+	failures += checkScalar<double>("double", points, normals, num_iterations);
+	failures += checkScalar<float>("float", points, normals, num_iterations);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// k nearest neighbour benchmark: Octree against the nanoflann kd-tree Mesh uses, on the same points.
+// Queries are the points themselves (as in the saliency / ICP code), the k-th distances of both indices are compared.
+//
+//      OctreeKnnBenchmark [k] [num_queries] [mesh.obj]
+//
+// without a mesh a noisy, wavy sheet similar to a scan surface is sampled.
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <igl/readOBJ.h>
+#include <point_matrix.h>
+#include <Octree.h>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static points_t samplePoints(std::size_t num_points)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> uniform(-10.0, 10.0);
+	std::normal_distribution<double> noise(0.0, 0.01);
+	points_t points(num_points, 3);
+	for (std::size_t i = 0; i < num_points; ++i)
+	{
+		const double x = uniform(rng);
+		const double y = uniform(rng);
+		points.row(i) << x, y, std::sin(0.5 * x) * std::cos(0.3 * y) + noise(rng);
+	}
+	return points;
+}
+
+struct KnnTiming
+{
+	double build = 0;
+	double query = 0;
+	std::vector<float> kth_distance;
+};
+
+template <typename Scalar>
+static KnnTiming benchKdTree(const points_t& points, const std::vector<std::size_t>& queries, std::size_t k)
+{
+	KnnTiming timing;
+	const PointMatrix<Scalar> matrix = points.cast<Scalar>();
+	Clock::time_point start = Clock::now();
+	PointKdTree<Scalar> kdtree(3, matrix);
+	kdtree.index->buildIndex();
+	timing.build = secondsSince(start);
+
+	std::vector<Eigen::Index> indices(k);
+	std::vector<Scalar> squared_distances(k);
+	timing.kth_distance.reserve(queries.size());
+	start = Clock::now();
+	for (std::size_t q : queries)
+	{
+		const std::size_t found = kdtree.index->knnSearch(matrix.row(q).data(), k, indices.data(), squared_distances.data());
+		timing.kth_distance.push_back(static_cast<float>(std::sqrt(squared_distances[found - 1])));
+	}
+	timing.query = secondsSince(start);
+	return timing;
+}
+
+static KnnTiming benchOctree(const points_t& points, const std::vector<std::size_t>& queries, std::size_t k, std::size_t leaf_size)
+{
+	KnnTiming timing;
+	std::vector<Vec3> vertices(points.rows());
+	for (Eigen::Index i = 0; i < points.rows(); ++i)
+		vertices[i] = Vec3(static_cast<float>(points(i, 0)), static_cast<float>(points(i, 1)), static_cast<float>(points(i, 2)));
+	Clock::time_point start = Clock::now();
+	Octree octree(vertices);
+	octree.build(leaf_size);
+	timing.build = secondsSince(start);
+
+	Octree::ResultSet results;
+	timing.kth_distance.reserve(queries.size());
+	start = Clock::now();
+	for (std::size_t q : queries)
+	{
+		octree.query_knn(vertices[q], static_cast<int>(k), results);
+		timing.kth_distance.push_back(results.idx_dist_pair.back().second);
+	}
+	timing.query = secondsSince(start);
+	return timing;
+}
+
+static void report(const std::string& name, const KnnTiming& timing, const KnnTiming& reference)
+{
+	std::size_t mismatches = 0;
+	for (std::size_t i = 0; i < timing.kth_distance.size(); ++i)
+	{
+		const float tolerance = 1e-5f * std::max(1.0f, reference.kth_distance[i]);
+		if (std::abs(timing.kth_distance[i] - reference.kth_distance[i]) > tolerance)
+			++mismatches;
+	}
+	std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(3)
+		<< std::setw(10) << timing.build << std::setw(10) << timing.query
+		<< std::setw(12) << mismatches << "\n";
+}
+
+int main(int argc, char* argv[])
+{
+	points_t points;
+	if (argc > 3)
+	{
+		Eigen::MatrixXd V;
+		Eigen::MatrixXi F;
+		if (!igl::readOBJ(argv[3], V, F) || V.rows() == 0)
+		{
+			std::cerr << "could not read " << argv[3] << "\n";
+			return 1;
+		}
+		points = toPointMatrix(V);
+	}
+	else
+	{
+		points = samplePoints(200000);
+	}
+	const std::size_t k = argc > 1 ? std::stoul(argv[1]) : 8;
+	const std::size_t num_queries = argc > 2 ? std::stoul(argv[2]) : static_cast<std::size_t>(points.rows());
+	if (k == 0 || k > static_cast<std::size_t>(points.rows()))
+	{
+		std::cerr << "k has to be in [1, " << points.rows() << "]\n";
+		return 1;
+	}
+
+	std::mt19937 rng(7);
+	std::vector<std::size_t> queries(num_queries);
+	for (std::size_t& q : queries)
+		q = rng() % static_cast<std::size_t>(points.rows());
+
+	std::cout << points.rows() << " points, " << num_queries << " queries, k = " << k << "\n";
+	std::cout << std::left << std::setw(24) << "index" << std::right << std::setw(10) << "build s"
+		<< std::setw(10) << "query s" << std::setw(12) << "mismatches" << "\n";
+	// the float kd-tree is the reference: the octree stores float coordinates as well
+	const KnnTiming reference = benchKdTree<float>(points, queries, k);
+	report("nanoflann kd (double)", benchKdTree<double>(points, queries, k), reference);
+	report("nanoflann kd (float)", reference, reference);
+	for (std::size_t leaf_size : { 8, 16, 32, 64 })
+		report("octree leaf " + std::to_string(leaf_size), benchOctree(points, queries, k, leaf_size), reference);
+	return 0;
+}
@@ -77,7 +77,9 @@ int main(int argc, char *argv[])
 		std::cout << "############################# MeshSaliencySampler Symmetry found! ###############################\n";
 		std::cout << "Prefiltering: " << res.time_for_prefiltering << "s\n";
 		std::cout << "ICP alignment: " << res.time_for_alignment << "s\n";
+		std::cout << "ICP iterations: " << res.icp_iterations << (res.icp_converged ? "" : " (not converged)") << "\n";
 		std::cout << "Symmetry plane calculation: " << res.time_for_sym_calculation << "s\n";
+		std::cout << "Whole mesh MAE: " << res.whole_mesh_mae << " (" << res.time_for_mae_evaluation << "s)\n";
 		std::cout << "Time total: " << res.time_total << "s\n";
 
 		{
@@ -199,7 +201,9 @@ int main(int argc, char *argv[])
 		std::cout << "############################# IntegralInvariantSignaturesSampler Symmetry found! ###############################\n";
 		std::cout << "Prefiltering: " << res.time_for_prefiltering << "s\n";
 		std::cout << "ICP alignment: " << res.time_for_alignment << "s\n";
+		std::cout << "ICP iterations: " << res.icp_iterations << (res.icp_converged ? "" : " (not converged)") << "\n";
 		std::cout << "Symmetry plane calculation: " << res.time_for_sym_calculation << "s\n";
+		std::cout << "Whole mesh MAE: " << res.whole_mesh_mae << " (" << res.time_for_mae_evaluation << "s)\n";
 		std::cout << "Time total: " << res.time_total << "s\n";
 
 		C1 = Eigen::MatrixXd(V1.rows(), 3);
@@ -239,7 +243,9 @@ int main(int argc, char *argv[])
 		std::cout << "############################# PassThroughSampler Symmetry found! ###############################\n";
 		std::cout << "Prefiltering: " << res.time_for_prefiltering << "s\n";
 		std::cout << "ICP alignment: " << res.time_for_alignment << "s\n";
+		std::cout << "ICP iterations: " << res.icp_iterations << (res.icp_converged ? "" : " (not converged)") << "\n";
 		std::cout << "Symmetry plane calculation: " << res.time_for_sym_calculation << "s\n";
+		std::cout << "Whole mesh MAE: " << res.whole_mesh_mae << " (" << res.time_for_mae_evaluation << "s)\n";
 		std::cout << "Time total: " << res.time_total << "s\n";
 
 		C1 = Eigen::MatrixXd(V1.rows(), 3);
@@ -0,0 +1,108 @@
+// brute force check of the Octree location code index: for every query the points closer than r have to lie in the
+// cell locate(query, d) or its 26 neighbours (find_cell / find_neighbours), d being the deepest level whose cells are
+// at least r wide along the axes on which the cloud has an extent. Run on a uniform cloud and on the degenerate ones
+// (planar, collinear, a single point, coincident points), whose root box has no extent on some axes.
+// Exits with 1 on a missed neighbour.
+//
+//      OctreeIndexCheck [num_points] [num_queries]
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <Octree.h>
+
+// deepest level whose cells are at least radius wide along every axis with an extent
+static std::size_t cellDepth(const Octree& octree, float radius)
+{
+	Vec3 width = octree.root_aabb.halfsize * 2;
+	std::size_t depth = 0;
+	// locate resolves up to level 21
+	while (depth < 21)
+	{
+		width = width / 2;
+		for (std::size_t a = 0; a < 3; ++a)
+		{
+			if (octree.root_aabb.halfsize[a] > 0 && width[a] < radius)
+				return depth;
+		}
+		++depth;
+	}
+	return depth;
+}
+
+// number of queries with a neighbour outside the 3 x 3 x 3 cells
+static std::size_t checkCloud(const std::string& name, const std::vector<Vec3>& points, const std::vector<Vec3>& queries, float radius)
+{
+	Octree octree(points);
+	octree.build(8);
+	const std::size_t depth = cellDepth(octree, radius);
+
+	std::size_t failures = 0;
+	std::vector<char> covered(points.size());
+	for (const Vec3& query : queries)
+	{
+		std::fill(covered.begin(), covered.end(), 0);
+		const uint64_t code = octree.locate(query, depth);
+		std::size_t cells[27];
+		std::size_t num_cells = octree.find_neighbours(code, Octree::Adjacency::VERTEX, cells);
+		const std::size_t center = octree.find_cell(code);
+		if (center != Octree::npos)
+			cells[num_cells++] = center;
+		for (std::size_t c = 0; c < num_cells; ++c)
+		{
+			const auto& node = octree.storage[cells[c]];
+			for (std::size_t i = node.data.start; i < node.data.start + node.data.size; ++i)
+				covered[octree.indices[i]] = 1;
+		}
+
+		for (std::size_t i = 0; i < points.size(); ++i)
+		{
+			if (!covered[i] && (points[i] - query).squared_length() < radius * radius)
+			{
+				++failures;
+				break;
+			}
+		}
+	}
+	std::cout << name << ": " << points.size() << " points, depth " << depth << ", " << failures << " of " << queries.size() << " queries missed neighbours\n";
+	return failures;
+}
+
+int main(int argc, char** argv)
+{
+	const std::size_t num_points = argc > 1 ? std::stoul(argv[1]) : 2000;
+	const std::size_t num_queries = argc > 2 ? std::stoul(argv[2]) : 400;
+	const float radius = 0.1f;
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> offset(-0.05f, 0.05f);
+
+	std::vector<Vec3> volume(num_points), plane(num_points), line(num_points);
+	for (std::size_t i = 0; i < num_points; ++i)
+	{
+		volume[i] = Vec3(uniform(rng), uniform(rng), uniform(rng));
+		plane[i] = Vec3(uniform(rng), uniform(rng), 0.0f);
+		line[i] = Vec3(uniform(rng), 0.0f, 0.0f);
+	}
+	const std::vector<Vec3> single(1, Vec3(0.3f, -0.2f, 0.5f));
+	const std::vector<Vec3> coincident(num_points, Vec3(0.3f, -0.2f, 0.5f));
+
+	// queries near the points of a cloud, off its planes along the degenerate axes
+	const auto near = [&](const std::vector<Vec3>& points)
+	{
+		std::vector<Vec3> queries(num_queries);
+		for (std::size_t q = 0; q < num_queries; ++q)
+			queries[q] = points[q % points.size()] + Vec3(offset(rng), offset(rng), offset(rng));
+		return queries;
+	};
+
+	std::size_t failures = 0;
+	failures += checkCloud("volume", volume, near(volume), radius);
+	failures += checkCloud("plane", plane, near(plane), radius);
+	failures += checkCloud("line", line, near(line), radius);
+	failures += checkCloud("single point", single, near(single), radius);
+	failures += checkCloud("coincident points", coincident, near(coincident), radius);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+// incremental scan fusion benchmark: Octree rebuilt after every change against DynamicOctree updated in place.
+// Scan patches (tiles of a noisy, wavy sheet) are appended one by one, then the last patch is moved by a few small
+// rigid transforms as in a registration loop. After every step both trees answer the same radius queries, the
+// neighbour counts are compared (ids of the dynamic tree are the indices of the static one).
+//
+//      OctreeUpdateBenchmark [num_patches] [points_per_patch] [leaf_size]
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <Octree.h>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// patch i covers the tile (i % 5, i / 5) of 4 x 4 units, neighbouring patches overlap by a quarter
+static std::vector<Vec3> samplePatch(std::size_t patch, std::size_t num_points, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> uniform(-2.5f, 2.5f);
+	std::normal_distribution<float> noise(0.0f, 0.01f);
+	const float x0 = 4.0f * static_cast<float>(patch % 5);
+	const float y0 = 4.0f * static_cast<float>(patch / 5);
+	std::vector<Vec3> points(num_points);
+	for (Vec3& point : points)
+	{
+		const float x = x0 + uniform(rng);
+		const float y = y0 + uniform(rng);
+		point = Vec3(x, y, std::sin(0.5f * x) * std::cos(0.3f * y) + noise(rng));
+	}
+	return points;
+}
+
+// small rotation about z around center followed by a shift
+static Vec3 rigidStep(const Vec3& point, const Vec3& center, float angle, const Vec3& shift)
+{
+	const float c = std::cos(angle), s = std::sin(angle);
+	const Vec3 d = point - center;
+	return center + Vec3(c * d[0] - s * d[1], s * d[0] + c * d[1], d[2]) + shift;
+}
+
+struct QueryCheck
+{
+	std::size_t neighbours = 0;
+	std::size_t mismatches = 0;
+};
+
+static QueryCheck compareQueries(const Octree& octree, const DynamicOctree& dynamic, const std::vector<Vec3>& queries, float radius)
+{
+	QueryCheck check;
+	std::vector<std::pair<size_t, float>> results;
+	for (const Vec3& query : queries)
+	{
+		const std::size_t expected = octree.query_radius(query, radius, results);
+		if (dynamic.query_radius(query, radius, results) != expected)
+			++check.mismatches;
+		check.neighbours += expected;
+	}
+	return check;
+}
+
+int main(int argc, char* argv[])
+{
+	const std::size_t num_patches = argc > 1 ? std::stoul(argv[1]) : 20;
+	const std::size_t patch_size = argc > 2 ? std::stoul(argv[2]) : 25000;
+	const std::size_t leaf_size = argc > 3 ? std::stoul(argv[3]) : 16;
+	const std::size_t num_registration_steps = 20;
+	const float radius = 0.1f;
+
+	std::mt19937 rng(42);
+	std::vector<Vec3> points;
+	Octree octree(points);
+	DynamicOctree dynamic(leaf_size);
+	double rebuild_time = 0, update_time = 0;
+	QueryCheck check;
+
+	std::vector<Vec3> queries(200);
+	for (std::size_t i = 0; i < num_patches; ++i)
+	{
+		const std::vector<Vec3> patch = samplePatch(i, patch_size, rng);
+
+		Clock::time_point start = Clock::now();
+		points.insert(points.end(), patch.begin(), patch.end());
+		octree.build(leaf_size);
+		rebuild_time += secondsSince(start);
+
+		start = Clock::now();
+		dynamic.insert(patch);
+		update_time += secondsSince(start);
+
+		for (Vec3& query : queries)
+			query = points[rng() % points.size()];
+		const QueryCheck step = compareQueries(octree, dynamic, queries, radius);
+		check.neighbours += step.neighbours;
+		check.mismatches += step.mismatches;
+	}
+	std::cout << num_patches << " patches of " << patch_size << " points, leaf size " << leaf_size << "\n";
+	std::cout << std::left << std::setw(28) << "" << std::right << std::setw(12) << "rebuild s" << std::setw(12) << "update s" << "\n";
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << std::left << std::setw(28) << "append patches" << std::right << std::setw(12) << rebuild_time << std::setw(12) << update_time << "\n";
+
+	// registration loop on the last patch
+	std::vector<std::size_t> last_patch(patch_size);
+	for (std::size_t j = 0; j < patch_size; ++j)
+		last_patch[j] = points.size() - patch_size + j;
+	const Vec3 center = points[last_patch[patch_size / 2]];
+	const Vec3 shift(0.002f, -0.001f, 0.0005f);
+	rebuild_time = update_time = 0;
+	for (std::size_t step = 0; step < num_registration_steps; ++step)
+	{
+		Clock::time_point start = Clock::now();
+		for (std::size_t id : last_patch)
+			points[id] = rigidStep(points[id], center, 0.002f, shift);
+		octree.build(leaf_size);
+		rebuild_time += secondsSince(start);
+
+		start = Clock::now();
+		dynamic.transform(last_patch, [&](const Vec3& point) { return rigidStep(point, center, 0.002f, shift); });
+		update_time += secondsSince(start);
+
+		for (Vec3& query : queries)
+			query = points[last_patch[rng() % patch_size]];
+		const QueryCheck step_check = compareQueries(octree, dynamic, queries, radius);
+		check.neighbours += step_check.neighbours;
+		check.mismatches += step_check.mismatches;
+	}
+	std::cout << std::left << std::setw(28) << "transform last patch" << std::right << std::setw(12) << rebuild_time << std::setw(12) << update_time << "\n";
+	std::cout << check.neighbours << " neighbours found, " << check.mismatches << " query mismatches\n";
+	return check.mismatches == 0 ? 0 : 1;
+}
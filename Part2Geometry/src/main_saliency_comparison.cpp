@@ -0,0 +1,133 @@
+// mesh saliency comparison: the heat diffusion pyramid against the radius search pyramid on the same mesh. Reports the
+// time of both, the correlation of the saliency values and the overlap of the most salient 1% and 5% of the vertices,
+// for both scale types.
+//
+//      SaliencyComparison [scale_base] [start_scale] [end_scale] [mesh.obj]
+//
+// without a mesh a bumpy 200 x 200 grid (40k vertices) is used.
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <igl/readOBJ.h>
+#include <igl/per_vertex_normals.h>
+#include <mesh.h>
+#include <mesh_saliency.h>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static Mesh bumpyGrid(int n)
+{
+	Eigen::MatrixXd V(n * n, 3);
+	Eigen::MatrixXi F(2 * (n - 1) * (n - 1), 3);
+	for (int i = 0; i < n; ++i)
+	{
+		for (int j = 0; j < n; ++j)
+		{
+			const double x = 4.0 * i / (n - 1) - 2.0;
+			const double y = 4.0 * j / (n - 1) - 2.0;
+			V.row(i * n + j) << x, y, 0.3 * std::sin(3.0 * x) * std::cos(2.0 * y) + 0.05 * std::sin(17.0 * x * y);
+		}
+	}
+	int f = 0;
+	for (int i = 0; i < n - 1; ++i)
+	{
+		for (int j = 0; j < n - 1; ++j)
+		{
+			const int a = i * n + j;
+			F.row(f++) << a, a + n, a + 1;
+			F.row(f++) << a + 1, a + n, a + n + 1;
+		}
+	}
+	Eigen::MatrixXd N;
+	igl::per_vertex_normals(V, F, N);
+	return Mesh(toPointMatrix(V), toPointMatrix(N), F);
+}
+
+// Pearson correlation of the per vertex values
+static double correlation(const Eigen::VectorXd& a, const Eigen::VectorXd& b)
+{
+	const Eigen::VectorXd x = a.array() - a.mean();
+	const Eigen::VectorXd y = b.array() - b.mean();
+	return x.dot(y) / (x.norm() * y.norm());
+}
+
+static std::vector<int> mostSalient(const Eigen::VectorXd& saliency, std::size_t count)
+{
+	std::vector<int> vertices(static_cast<std::size_t>(saliency.size()));
+	for (std::size_t v = 0; v < vertices.size(); ++v)
+		vertices[v] = static_cast<int>(v);
+	std::partial_sort(vertices.begin(), vertices.begin() + count, vertices.end(), [&saliency](int lhs, int rhs) { return saliency(lhs) > saliency(rhs); });
+	vertices.resize(count);
+	std::sort(vertices.begin(), vertices.end());
+	return vertices;
+}
+
+// fraction of the most salient vertices of a that are also among the most salient of b
+static double topOverlap(const Eigen::VectorXd& a, const Eigen::VectorXd& b, double fraction)
+{
+	const std::size_t count = std::max<std::size_t>(1, static_cast<std::size_t>(fraction * static_cast<double>(a.size())));
+	const std::vector<int> top_a = mostSalient(a, count);
+	const std::vector<int> top_b = mostSalient(b, count);
+	std::vector<int> common;
+	std::set_intersection(top_a.begin(), top_a.end(), top_b.begin(), top_b.end(), std::back_inserter(common));
+	return static_cast<double>(common.size()) / static_cast<double>(count);
+}
+
+int main(int argc, char* argv[])
+{
+	const double scale_base = argc > 1 ? std::stod(argv[1]) : 0.002;
+	const std::size_t start_scale = argc > 2 ? std::stoul(argv[2]) : 1;
+	const std::size_t end_scale = argc > 3 ? std::stoul(argv[3]) : 5;
+
+	Mesh mesh;
+	if (argc > 4)
+	{
+		Eigen::MatrixXd V;
+		Eigen::MatrixXi F;
+		if (!igl::readOBJ(argv[4], V, F) || V.rows() == 0)
+		{
+			std::cerr << "could not read " << argv[4] << "\n";
+			return 1;
+		}
+		Eigen::MatrixXd N;
+		igl::per_vertex_normals(V, F, N);
+		mesh = Mesh(toPointMatrix(V), toPointMatrix(N), F);
+	}
+	else
+	{
+		mesh = bumpyGrid(200);
+	}
+
+	std::cout << mesh.vertices().rows() << " vertices, scale base " << scale_base << ", scales " << start_scale << " - " << end_scale << "\n";
+	std::cout << std::left << std::setw(12) << "scales" << std::right << std::setw(10) << "radius s" << std::setw(10) << "heat s"
+		<< std::setw(13) << "correlation" << std::setw(10) << "top 1%" << std::setw(10) << "top 5%" << "\n";
+	const ScaleType scale_types[] = { ScaleType::DOUBLE_SIGMA_EVERY_SCALE, ScaleType::LINEAR_INCREASE };
+	const char* scale_type_names[] = { "doubling", "linear" };
+	for (std::size_t t = 0; t < 2; ++t)
+	{
+		Eigen::VectorXd radius_saliency;
+		Eigen::VectorXd heat_saliency;
+		Clock::time_point start = Clock::now();
+		calculateMeshSaliency(mesh, scale_base, start_scale, end_scale, radius_saliency, scale_types[t], SmoothingType::RADIUS_SEARCH);
+		const double radius_time = secondsSince(start);
+		start = Clock::now();
+		calculateMeshSaliency(mesh, scale_base, start_scale, end_scale, heat_saliency, scale_types[t], SmoothingType::HEAT_DIFFUSION);
+		const double heat_time = secondsSince(start);
+
+		std::cout << std::left << std::setw(12) << scale_type_names[t] << std::right << std::fixed << std::setprecision(3)
+			<< std::setw(10) << radius_time << std::setw(10) << heat_time
+			<< std::setw(13) << correlation(radius_saliency, heat_saliency)
+			<< std::setw(10) << topOverlap(radius_saliency, heat_saliency, 0.01)
+			<< std::setw(10) << topOverlap(radius_saliency, heat_saliency, 0.05) << "\n";
+	}
+	return 0;
+}
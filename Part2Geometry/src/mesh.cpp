@@ -1,8 +1,7 @@
 #include "..\include\mesh.h"
-#include <igl/adjacency_list.h>
 
-Mesh::Mesh() :
-	m_kdtree(nullptr),
+template <typename Scalar>
+MeshT<Scalar>::MeshT() :
 	m_vertices(),
 	m_normals(),
 	m_faces(),
@@ -10,97 +9,66 @@ Mesh::Mesh() :
 {
 }
 
-Mesh::Mesh(const Eigen::MatrixXd & _vertices, const Eigen::MatrixXd & _normals, const Eigen::MatrixXi & _faces)	:
-	m_kdtree(nullptr),
+template <typename Scalar>
+MeshT<Scalar>::MeshT(const points_type & _vertices, const points_type & _normals, const Eigen::MatrixXi & _faces)	:
 	m_vertices(_vertices),
 	m_normals(_normals),
 	m_faces(_faces),
 	m_colors()
 {
-	// build kdtree
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
-
-	// build adjencency list (hope that thing works. documentation is GREAT!)
-	igl::adjacency_list(_faces, m_adjacency_list);
-	recalculateTriangleList();
 }
 
-Mesh::Mesh(const Eigen::MatrixXd& _vertices, const Eigen::MatrixXd& _normals, const Eigen::MatrixXi& _faces, const Eigen::MatrixXd& _colors) :
-	m_kdtree(nullptr),
+template <typename Scalar>
+MeshT<Scalar>::MeshT(const points_type& _vertices, const points_type& _normals, const Eigen::MatrixXi& _faces, const Eigen::MatrixXd& _colors) :
 	m_vertices(_vertices),
 	m_normals(_normals),
 	m_faces(_faces),
 	m_colors(_colors)
 {
-	// build kdtree
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
-
-	// build adjencency list (hope that thing works. documentation is GREAT!)
-	igl::adjacency_list(_faces, m_adjacency_list);
-	recalculateTriangleList();
 }
 
-Mesh::Mesh(Eigen::MatrixXd && _vertices, Eigen::MatrixXd && _normals, Eigen::MatrixXi && _faces) :
-	m_kdtree(nullptr),
+template <typename Scalar>
+MeshT<Scalar>::MeshT(points_type && _vertices, points_type && _normals, Eigen::MatrixXi && _faces) :
 	m_vertices(std::move(_vertices)),
 	m_normals(std::move(_normals)),
 	m_faces(std::move(_faces))
 {
-	// build kdtree
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
-
-	// build adjencency list (hope that thing works. documentation is GREAT!)
-	igl::adjacency_list(_faces, m_adjacency_list);
-	recalculateTriangleList();
 }
 
-Mesh::Mesh(Eigen::MatrixXd&& _vertices, Eigen::MatrixXd&& _normals, Eigen::MatrixXi&& _faces, Eigen::MatrixXd& _colors) :
-	m_kdtree(nullptr),
+template <typename Scalar>
+MeshT<Scalar>::MeshT(points_type&& _vertices, points_type&& _normals, Eigen::MatrixXi&& _faces, Eigen::MatrixXd& _colors) :
 	m_vertices(std::move(_vertices)),
 	m_normals(std::move(_normals)),
 	m_faces(std::move(_faces)),
 	m_colors(std::move(_colors))
 {
-	// build kdtree
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
-
-	// build adjencency list (hope that thing works. documentation is GREAT!)
-	igl::adjacency_list(_faces, m_adjacency_list);
-	recalculateTriangleList();
 }
 
-Mesh::Mesh(const Mesh& _other) :
-	m_kdtree(nullptr),
+template <typename Scalar>
+MeshT<Scalar>::MeshT(const MeshT& _other) :
 	m_vertices(_other.m_vertices),
 	m_normals(_other.m_normals),
 	m_faces(_other.m_faces),
 	m_colors(_other.m_colors)
 {
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
-
-	// build adjencency list (hope that thing works. documentation is GREAT!)
-	igl::adjacency_list(m_faces, m_adjacency_list);
-	recalculateTriangleList();
+	// share instead of rebuilding, the derived structures are immutable
+	copyCaches(_other);
 }
 
-Mesh::Mesh(Mesh&& _other) :
+template <typename Scalar>
+MeshT<Scalar>::MeshT(MeshT&& _other) :
 	m_vertices(std::move(_other.m_vertices)),
 	m_normals(std::move(_other.m_normals)),
 	m_faces(std::move(_other.m_faces)),
-	m_colors(std::move(_other.m_colors)),
-	m_kdtree(std::move(_other.m_kdtree)),
-	m_adjacency_list(std::move(_other.m_adjacency_list)),
-	m_triangle_list(std::move(_other.m_triangle_list))
+	m_colors(std::move(_other.m_colors))
 {
-	_other.m_kdtree.reset();
+	copyCaches(_other);
+	_other.invalidateVertexStructures();
+	_other.invalidateFaceStructures();
 }
 
-Mesh& Mesh::operator=(const Mesh& _other)
+template <typename Scalar>
+MeshT<Scalar>& MeshT<Scalar>::operator=(const MeshT& _other)
 {
 	if (this == &_other)
 		return *this;
@@ -109,17 +77,13 @@ Mesh& Mesh::operator=(const Mesh& _other)
 	m_normals = _other.m_normals;
 	m_faces = _other.m_faces;
 	m_colors = _other.m_colors;
-
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
-
-	m_adjacency_list = _other.m_adjacency_list;
-	m_triangle_list = _other.m_triangle_list;
+	copyCaches(_other);
 
 	return *this;
 }
 
-Mesh& Mesh::operator=(Mesh&& _other)
+template <typename Scalar>
+MeshT<Scalar>& MeshT<Scalar>::operator=(MeshT&& _other)
 {
 	if (this == &_other)
 		return *this;
@@ -128,35 +92,109 @@ Mesh& Mesh::operator=(Mesh&& _other)
 	m_normals = std::move(_other.m_normals);
 	m_faces = std::move(_other.m_faces);
 	m_colors = std::move(_other.m_colors);
-	m_kdtree = std::move(_other.m_kdtree);
-	m_adjacency_list = std::move(_other.m_adjacency_list);
-	m_triangle_list = std::move(_other.m_triangle_list);
+	copyCaches(_other);
 
-	_other.m_kdtree.reset();
+	_other.invalidateVertexStructures();
+	_other.invalidateFaceStructures();
 	 
 	return *this;
 }
 
-void Mesh::recalculateKdTree()
+template <typename Scalar>
+template <typename T, typename Builder>
+const T& MeshT<Scalar>::getCached(Cached<T>& cache, Builder build) const
 {
-	m_kdtree.reset(new kdtree_t(3, m_vertices));
-	m_kdtree->index->buildIndex();
+	const T* value = cache.ptr.load(std::memory_order_acquire);
+	if (value)
+		return *value;
+
+	// first access: build once, concurrent readers wait for it
+	std::lock_guard<std::mutex> lock(m_cache_mutex);
+	if (!cache.owner)
+		cache.set(build());
+	return *cache.owner;
 }
 
-void Mesh::recalculateTriangleList()
+template <typename Scalar>
+const MeshConnectivity& MeshT<Scalar>::connectivity() const
 {
-	m_triangle_list.reserve(m_vertices.size());
-	m_triangle_list.clear();
+	return getCached(m_connectivity, [this]()
+	{
+		return std::make_shared<const MeshConnectivity>(m_faces, m_vertices.rows());
+	});
+}
 
-	for (Eigen::Index v = 0; v < m_vertices.size(); ++v)
+template <typename Scalar>
+const typename MeshT<Scalar>::kdtree_type& MeshT<Scalar>::kdtree() const
+{
+	// built over a snapshot of the vertices, mutableVertices() drops it
+	return getCached(m_kdtree, [this]()
 	{
-		m_triangle_list.push_back(std::vector<Eigen::DenseIndex>());
-	}
+		return std::make_shared<const KdTreeIndex>(m_vertices);
+	}).kdtree;
+}
 
-	for (Eigen::Index f = 0; f < m_faces.rows(); ++f)
+template <typename Scalar>
+const CotanLaplacian& MeshT<Scalar>::cotan_laplacian() const
+{
+	return getCached(m_cotan_laplacian, [this]()
 	{
-		m_triangle_list[m_faces(f, 0)].push_back(f);
-		m_triangle_list[m_faces(f, 1)].push_back(f);
-		m_triangle_list[m_faces(f, 2)].push_back(f);
-	}
+		std::shared_ptr<CotanLaplacian> operators = std::make_shared<CotanLaplacian>(m_faces, m_vertices.rows());
+		operators->assemble(m_vertices.template cast<double>());
+		return std::shared_ptr<const CotanLaplacian>(std::move(operators));
+	});
+}
+
+template <typename Scalar>
+std::shared_ptr<const CotanLaplacian> MeshT<Scalar>::shared_cotan_laplacian() const
+{
+	cotan_laplacian();
+	std::lock_guard<std::mutex> lock(m_cache_mutex);
+	return m_cotan_laplacian.owner;
+}
+
+template <typename Scalar>
+void MeshT<Scalar>::recalculateKdTree()
+{
+	m_kdtree.set(nullptr);
 }
+
+template <typename Scalar>
+void MeshT<Scalar>::recalculateConnectivity()
+{
+	m_connectivity.set(nullptr);
+}
+
+template <typename Scalar>
+void MeshT<Scalar>::recalculateCotanLaplacian()
+{
+	m_cotan_laplacian.set(nullptr);
+}
+
+template <typename Scalar>
+void MeshT<Scalar>::copyCaches(const MeshT& _other)
+{
+	std::lock_guard<std::mutex> lock(_other.m_cache_mutex);
+	m_kdtree.set(_other.m_kdtree.owner);
+	m_connectivity.set(_other.m_connectivity.owner);
+	m_cotan_laplacian.set(_other.m_cotan_laplacian.owner);
+}
+
+template <typename Scalar>
+void MeshT<Scalar>::invalidateVertexStructures()
+{
+	recalculateKdTree();
+	// sized by the vertex count
+	recalculateConnectivity();
+	recalculateCotanLaplacian();
+}
+
+template <typename Scalar>
+void MeshT<Scalar>::invalidateFaceStructures()
+{
+	recalculateConnectivity();
+	recalculateCotanLaplacian();
+}
+
+template class MeshT<double>;
+template class MeshT<float>;
@@ -0,0 +1,114 @@
+#include <mesh_connectivity.h>
+#include <algorithm>
+#include <numeric>
+#include <parallel.h>
+
+MeshConnectivity::MeshConnectivity(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, std::size_t num_threads)
+{
+	const int nthreads = Parallel::numThreads(num_threads);
+	buildVertexFaces(faces, num_vertices, nthreads);
+	buildVertexVertices(faces, num_vertices, nthreads);
+	buildTwins(faces, nthreads);
+}
+
+void MeshConnectivity::buildVertexFaces(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, int num_threads)
+{
+	std::vector<int>& offsets = m_vertex_faces.m_offsets;
+	std::vector<int>& indices = m_vertex_faces.m_indices;
+	offsets.assign(static_cast<std::size_t>(num_vertices) + 1, 0);
+
+	// counting pass: number of faces around every vertex, shifted by one for the prefix sum
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+	for (Eigen::Index f = 0; f < faces.rows(); ++f)
+	{
+		for (Eigen::Index k = 0; k < 3; ++k)
+		{
+#pragma omp atomic
+			++offsets[static_cast<std::size_t>(faces(f, k)) + 1];
+		}
+	}
+	std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+	// scatter the faces into their slots, the order within a list depends on the schedule so sort afterwards
+	indices.resize(static_cast<std::size_t>(offsets.back()));
+	std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+	for (Eigen::Index f = 0; f < faces.rows(); ++f)
+	{
+		for (Eigen::Index k = 0; k < 3; ++k)
+		{
+			int slot;
+#pragma omp atomic capture
+			slot = cursor[static_cast<std::size_t>(faces(f, k))]++;
+			indices[static_cast<std::size_t>(slot)] = static_cast<int>(f);
+		}
+	}
+
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(num_threads)
+	for (Eigen::Index v = 0; v < num_vertices; ++v)
+		std::sort(indices.begin() + offsets[v], indices.begin() + offsets[v + 1]);
+}
+
+void MeshConnectivity::buildVertexVertices(const Eigen::MatrixXi& faces, Eigen::Index num_vertices, int num_threads)
+{
+	const std::vector<int>& face_offsets = m_vertex_faces.m_offsets;
+	const std::vector<int>& face_indices = m_vertex_faces.m_indices;
+	std::vector<int>& offsets = m_vertex_vertices.m_offsets;
+	std::vector<int>& indices = m_vertex_vertices.m_indices;
+	offsets.assign(static_cast<std::size_t>(num_vertices) + 1, 0);
+
+	// every incident face contributes (at most) two neighbours, collect them in a slice of twice the
+	// face count and deduplicate in place, which gives the neighbour counts for the prefix sum
+	std::vector<int> scratch(2 * face_indices.size());
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(num_threads)
+	for (Eigen::Index v = 0; v < num_vertices; ++v)
+	{
+		int* first = scratch.data() + 2 * face_offsets[v];
+		int* last = first;
+		for (int n = face_offsets[v]; n < face_offsets[v + 1]; ++n)
+		{
+			const Eigen::Index f = face_indices[static_cast<std::size_t>(n)];
+			for (Eigen::Index k = 0; k < 3; ++k)
+			{
+				if (faces(f, k) != v)
+					*last++ = faces(f, k);
+			}
+		}
+		std::sort(first, last);
+		offsets[v + 1] = static_cast<int>(std::unique(first, last) - first);
+	}
+	std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+	indices.resize(static_cast<std::size_t>(offsets.back()));
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+	for (Eigen::Index v = 0; v < num_vertices; ++v)
+	{
+		const int* first = scratch.data() + 2 * face_offsets[v];
+		std::copy(first, first + (offsets[v + 1] - offsets[v]), indices.begin() + offsets[v]);
+	}
+}
+
+void MeshConnectivity::buildTwins(const Eigen::MatrixXi& faces, int num_threads)
+{
+	const HalfEdgeView half_edges(faces, m_twins);
+	const IndexLists& vertex_faces = m_vertex_faces;
+	m_twins.assign(3 * static_cast<std::size_t>(faces.rows()), -1);
+
+	// the twin of a -> b is the half-edge b -> a of one of the faces around b
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+	for (Eigen::Index e = 0; e < static_cast<Eigen::Index>(m_twins.size()); ++e)
+	{
+		const int h = static_cast<int>(e);
+		const int a = half_edges.from(h);
+		const int b = half_edges.to(h);
+		for (int f : vertex_faces[static_cast<std::size_t>(b)])
+		{
+			const int o = half_edges.outgoing(f, b);
+			if (o != h && half_edges.to(o) == a)
+			{
+				m_twins[static_cast<std::size_t>(h)] = o;
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,233 @@
+#include <mesh_multigrid.h>
+#include <algorithm>
+#include <cmath>
+
+constexpr Eigen::Index MeshMultigrid::coarse_size;
+constexpr Eigen::Index MeshMultigrid::max_direct_size;
+constexpr double MeshMultigrid::coarse_tolerance;
+constexpr std::size_t MeshMultigrid::smoothing_steps;
+constexpr double MeshMultigrid::strength_threshold;
+
+// cluster index of every row: a row whose strong neighbours are all unclustered starts a cluster with them, the
+// remaining rows join the cluster of a strong neighbour (or form their own); returns the number of clusters. Rows
+// without any coupling stay out of the coarse level (-1), the l1-Jacobi smoother solves them exactly.
+// Clustering along the strong couplings only keeps the weak edges of the curvature weights and of thin triangles
+// between clusters, so the coarse levels still resolve them. With threshold 0 every non-zero coupling is strong.
+static Eigen::Index clusterRows(const MeshMultigrid::matrix_t& A, double threshold, std::vector<int>& cluster)
+{
+	const int* outer = A.outerIndexPtr();
+	const int* inner = A.innerIndexPtr();
+	const double* values = A.valuePtr();
+	const Eigen::Index n = A.rows();
+	const Eigen::VectorXd diagonal = A.diagonal();
+	const auto strong = [&](Eigen::Index i, int k)
+	{
+		const int j = inner[k];
+		return j != i && values[k] != 0.0 && std::abs(values[k]) >= threshold * std::sqrt(std::abs(diagonal(i) * diagonal(j)));
+	};
+
+	cluster.assign(static_cast<std::size_t>(n), -1);
+	int num_clusters = 0;
+	for (Eigen::Index i = 0; i < n; ++i)
+	{
+		if (cluster[static_cast<std::size_t>(i)] >= 0)
+			continue;
+		bool free = true;
+		int num_strong = 0;
+		for (int k = outer[i]; k < outer[i + 1] && free; ++k)
+		{
+			if (strong(i, k))
+			{
+				free = cluster[static_cast<std::size_t>(inner[k])] < 0;
+				++num_strong;
+			}
+		}
+		if (!free || num_strong == 0)
+			continue;
+		for (int k = outer[i]; k < outer[i + 1]; ++k)
+		{
+			if (strong(i, k))
+				cluster[static_cast<std::size_t>(inner[k])] = num_clusters;
+		}
+		cluster[static_cast<std::size_t>(i)] = num_clusters++;
+	}
+	// joining in place would let a cluster grow along a chain, so the rows join the clusters of the first pass
+	std::vector<int> joined(cluster);
+	for (Eigen::Index i = 0; i < n; ++i)
+	{
+		if (cluster[static_cast<std::size_t>(i)] >= 0)
+			continue;
+		for (int k = outer[i]; k < outer[i + 1]; ++k)
+		{
+			if (strong(i, k) && cluster[static_cast<std::size_t>(inner[k])] >= 0)
+			{
+				joined[static_cast<std::size_t>(i)] = cluster[static_cast<std::size_t>(inner[k])];
+				break;
+			}
+		}
+		if (joined[static_cast<std::size_t>(i)] >= 0)
+			continue;
+		for (int k = outer[i]; k < outer[i + 1]; ++k)
+		{
+			if (inner[k] != i && values[k] != 0.0)
+			{
+				joined[static_cast<std::size_t>(i)] = num_clusters++;
+				break;
+			}
+		}
+	}
+	cluster.swap(joined);
+	return num_clusters;
+}
+
+// inverse l1 norms of the rows: x += D_l1^-1 (b - A x) converges for every symmetric positive definite A
+static Eigen::VectorXd inverseRowNorms(const MeshMultigrid::matrix_t& A)
+{
+	Eigen::VectorXd inv_l1(A.rows());
+	for (Eigen::Index i = 0; i < A.rows(); ++i)
+	{
+		double norm = 0.0;
+		for (MeshMultigrid::matrix_t::InnerIterator it(A, i); it; ++it)
+			norm += std::abs(it.value());
+		inv_l1(i) = norm > 0.0 ? 1.0 / norm : 0.0;
+	}
+	return inv_l1;
+}
+
+void MeshMultigrid::setup(matrix_t A)
+{
+	m_levels.clear();
+	m_info = Eigen::Success;
+	while (true)
+	{
+		m_levels.emplace_back();
+		Level& level = m_levels.back();
+		level.A = std::move(A);
+		level.A.makeCompressed();
+		level.inv_l1 = inverseRowNorms(level.A);
+		const Eigen::Index n = level.A.rows();
+		level.x.resize(n);
+		level.b.resize(n);
+		level.r.resize(n);
+		if (n <= coarse_size)
+			break;
+
+		std::vector<int> cluster;
+		Eigen::Index num_clusters = clusterRows(level.A, strength_threshold, cluster);
+		// too few strong couplings to shrink the level, aggregate along all of them
+		if (num_clusters > n / 2)
+			num_clusters = clusterRows(level.A, 0.0, cluster);
+		// every coupled row is in a cluster of two or more now, so this only stops on (nearly) diagonal levels
+		if (num_clusters == 0 || num_clusters > n / 2)
+			break;
+
+		// P = (I - omega D^-1 A) P0 with the cluster indicator P0 and omega = 4 / 3 / rho(D^-1 A), rho bounded by
+		// the largest l1 row norm over the diagonal
+		double rho = 0.0;
+		Eigen::VectorXd inv_diagonal(n);
+		for (Eigen::Index i = 0; i < n; ++i)
+		{
+			const double diagonal = level.A.coeff(i, i);
+			inv_diagonal(i) = diagonal != 0.0 ? 1.0 / diagonal : 0.0;
+			rho = std::max(rho, inv_diagonal(i) / level.inv_l1(i));
+		}
+		const double omega = 4.0 / 3.0 / std::max(rho, 1.0);
+		std::vector<Eigen::Triplet<double>> triplets;
+		triplets.reserve(static_cast<std::size_t>(level.A.nonZeros()));
+		for (Eigen::Index i = 0; i < n; ++i)
+		{
+			for (matrix_t::InnerIterator it(level.A, i); it; ++it)
+			{
+				const int c = cluster[static_cast<std::size_t>(it.col())];
+				if (c >= 0)
+					triplets.emplace_back(static_cast<int>(i), c, (it.col() == i ? 1.0 : 0.0) - omega * inv_diagonal(i) * it.value());
+			}
+		}
+		level.P.resize(n, num_clusters);
+		level.P.setFromTriplets(triplets.begin(), triplets.end());
+		level.R = level.P.transpose();
+		A = matrix_t(level.R * matrix_t(level.A * level.P));
+		A.prune(0.0);
+	}
+
+	// the coarsest level only stays large when its rows are nearly decoupled, which is where Jacobi preconditioned
+	// CG converges fast; it keeps a reference to the level matrix
+	const matrix_t& coarsest = m_levels.back().A;
+	m_coarse_direct = coarsest.rows() <= max_direct_size;
+	if (m_coarse_direct)
+	{
+		m_coarse_solver.compute(Eigen::SparseMatrix<double>(coarsest));
+		if (m_coarse_solver.info() != Eigen::Success)
+			m_info = Eigen::NumericalIssue;
+	}
+	else
+	{
+		m_coarse_iterative_solver.setTolerance(coarse_tolerance);
+		m_coarse_iterative_solver.compute(coarsest);
+		if (m_coarse_iterative_solver.info() != Eigen::Success)
+			m_info = Eigen::NumericalIssue;
+	}
+}
+
+void MeshMultigrid::cycle(std::size_t l) const
+{
+	const Level& level = m_levels[l];
+	if (l + 1 == m_levels.size())
+	{
+		if (m_coarse_direct)
+			level.x = m_coarse_solver.solve(level.b);
+		else
+			level.x = m_coarse_iterative_solver.solve(level.b);
+		return;
+	}
+
+	// pre-smoothing from zero, coarse correction of the residual, post-smoothing: the cycle is a symmetric operator
+	level.x = level.inv_l1.cwiseProduct(level.b);
+	for (std::size_t s = 1; s < smoothing_steps; ++s)
+	{
+		level.r.noalias() = level.b - level.A * level.x;
+		level.x += level.inv_l1.cwiseProduct(level.r);
+	}
+	level.r.noalias() = level.b - level.A * level.x;
+	const Level& coarse = m_levels[l + 1];
+	coarse.b.noalias() = level.R * level.r;
+	cycle(l + 1);
+	level.x.noalias() += level.P * coarse.x;
+	for (std::size_t s = 0; s < smoothing_steps; ++s)
+	{
+		level.r.noalias() = level.b - level.A * level.x;
+		level.x += level.inv_l1.cwiseProduct(level.r);
+	}
+}
+
+Eigen::VectorXd MeshMultigrid::solve(const Eigen::VectorXd& b) const
+{
+	m_levels.front().b = b;
+	cycle(0);
+	return m_levels.front().x;
+}
+
+std::size_t MeshMultigrid::solveIterative(const Eigen::VectorXd& b, Eigen::VectorXd& x, double tolerance, std::size_t max_cycles) const
+{
+	const matrix_t& A = m_levels.front().A;
+	if (x.size() != b.size())
+		x = Eigen::VectorXd::Zero(b.size());
+	const double threshold = tolerance * b.norm();
+	Eigen::VectorXd r = b - A * x;
+	std::size_t cycles = 0;
+	while (cycles < max_cycles && r.norm() > threshold)
+	{
+		x += solve(r);
+		r.noalias() = b - A * x;
+		++cycles;
+	}
+	return cycles;
+}
+
+double MeshMultigrid::operatorComplexity() const
+{
+	double non_zeros = 0.0;
+	for (const Level& level : m_levels)
+		non_zeros += static_cast<double>(level.A.nonZeros());
+	return m_levels.empty() ? 0.0 : non_zeros / static_cast<double>(m_levels.front().A.nonZeros());
+}
@@ -1,28 +1,169 @@
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
-#include <igl/cotmatrix.h>
-#include <igl/massmatrix.h>
-#include <igl/invert_diag.h>
 #include <cmath>
 #include <mesh.h>
 #include <iostream>
 #include <algorithm>
 #include <mesh_saliency.h>
+#include <parallel.h>
+#include <vector>
+#include <stdexcept>
 #include <igl/opengl/glfw/Viewer.h>
 
+// G_pyr(v, l): gaussian weighted average of mean curvature with sdev sigmas[l] (non-decreasing) around v,
+// truncated at 2 sigma; doubling_sigma tells that every level has twice the sigma of the previous one
+template <typename Scalar>
+static void radiusSearchPyramid(const MeshT<Scalar>& mesh, const Eigen::VectorXd& mean_curvatures, const std::vector<double>& sigmas, bool doubling_sigma, std::size_t num_threads, Eigen::MatrixXd& G_pyr)
+{
+	// squared search radius (2 sigma)^2 per level, in the precision of the kd-tree distances
+	std::vector<Scalar> search_radii(sigmas.size());
+	for (std::size_t l = 0; l < sigmas.size(); ++l)
+		search_radii[l] = static_cast<Scalar>((2.0 * sigmas[l]) * (2.0 * sigmas[l]));
+	const Scalar max_search_radius = *std::max_element(search_radii.begin(), search_radii.end());
+
+	// one radius search per vertex at the largest radius serves every level, a neighbour contributes to all
+	// levels whose radius contains it. With doubling sigmas the weight of the next finer level is the current
+	// one to the 4th power.
+	const std::size_t top_level = sigmas.size() - 1;
+	const typename MeshT<Scalar>::kdtree_type& kdtree = mesh.kdtree();
+#pragma omp parallel num_threads(Parallel::numThreads(num_threads))
+	{
+		std::vector<std::pair<Eigen::Index, Scalar>> rad_search_res;
+		std::vector<double> weights(sigmas.size());
+		std::vector<double> gs(sigmas.size());
+#pragma omp for schedule(dynamic, 256)
+		for (Eigen::DenseIndex v = 0; v < mesh.vertices().rows(); ++v)
+		{
+			rad_search_res.clear();
+			kdtree.index->radiusSearch(mesh.vertices().row(v).data(), max_search_radius, rad_search_res, nanoflann::SearchParams(0, 0.0, false));
+			std::fill(weights.begin(), weights.end(), 0.0);
+			std::fill(gs.begin(), gs.end(), 0.0);
+			for (std::size_t i = 0; i < rad_search_res.size(); ++i)
+			{
+				const double curvature = mean_curvatures(rad_search_res[i].first);
+				const double squared_distance = static_cast<double>(rad_search_res[i].second);
+				std::size_t first_level = 0;
+				while (first_level <= top_level && !(rad_search_res[i].second < search_radii[first_level]))
+					++first_level;
+				if (first_level > top_level)
+					continue;
+				if (doubling_sigma)
+				{
+					double w = std::exp(-squared_distance / (2.0 * sigmas[top_level] * sigmas[top_level]));
+					for (std::size_t l = top_level; ; --l)
+					{
+						gs[l] += curvature * w;
+						weights[l] += w;
+						if (l == first_level)
+							break;
+						w *= w;
+						w *= w;
+					}
+				}
+				else
+				{
+					for (std::size_t l = first_level; l <= top_level; ++l)
+					{
+						double w = std::exp(-squared_distance / (2.0 * sigmas[l] * sigmas[l]));
+						gs[l] += curvature * w;
+						weights[l] += w;
+					}
+				}
+			}
+			for (Eigen::DenseIndex scaleidx = 0; scaleidx < static_cast<Eigen::DenseIndex>(sigmas.size()); ++scaleidx)
+			{
+				const double weight = weights[scaleidx];
+				const double g = gs[scaleidx];
+				if (weight != 0.0)
+					G_pyr(v, scaleidx) = g / weight;
+				else
+					G_pyr(v, scaleidx) = 0.0;
+			}
+		}
+	}
+}
+
+// same pyramid as radiusSearchPyramid from an octree over the vertices: nodes inside the 2 sigma sphere and
+// smaller than about 0.2 sigma enter through their aggregated curvature instead of vertex by vertex
+template <typename Scalar>
+static void hierarchicalPyramid(const MeshT<Scalar>& mesh, const Eigen::VectorXd& mean_curvatures, const std::vector<double>& sigmas, std::size_t num_threads, Eigen::MatrixXd& G_pyr)
+{
+	const double tolerance = 0.05;
+	std::vector<Vec3> points(static_cast<std::size_t>(mesh.vertices().rows()));
+	for (Eigen::DenseIndex v = 0; v < mesh.vertices().rows(); ++v)
+		points[v] = Vec3(static_cast<float>(mesh.vertices()(v, 0)), static_cast<float>(mesh.vertices()(v, 1)), static_cast<float>(mesh.vertices()(v, 2)));
+	const std::vector<double> curvatures(mean_curvatures.data(), mean_curvatures.data() + mean_curvatures.size());
+	Octree octree(points);
+	octree.build(16, num_threads);
+	const std::vector<PointAggregate> aggregates = octree.aggregate_points(curvatures);
+
+	std::vector<float> level_sigmas(sigmas.size());
+	std::vector<float> level_radii(sigmas.size());
+	for (std::size_t l = 0; l < sigmas.size(); ++l)
+	{
+		level_sigmas[l] = static_cast<float>(sigmas[l]);
+		level_radii[l] = static_cast<float>(2.0 * sigmas[l]);
+	}
+
+#pragma omp parallel num_threads(Parallel::numThreads(num_threads))
+	{
+		std::vector<GaussianSum> sums(sigmas.size());
+#pragma omp for schedule(dynamic, 256)
+		for (Eigen::DenseIndex v = 0; v < mesh.vertices().rows(); ++v)
+		{
+			octree.gaussian_sums(aggregates, curvatures, points[v], level_sigmas.data(), level_radii.data(), sigmas.size(), tolerance, sums.data());
+			for (Eigen::DenseIndex scaleidx = 0; scaleidx < static_cast<Eigen::DenseIndex>(sigmas.size()); ++scaleidx)
+				G_pyr(v, scaleidx) = sums[scaleidx].weight != 0.0 ? sums[scaleidx].weighted_sum / sums[scaleidx].weight : 0.0;
+		}
+	}
+}
 
+// same pyramid by implicit heat diffusion: a gaussian of variance sigma^2 is the heat kernel at t = sigma^2 / 2.
+// Level l is reached from level l - 1 in num_substeps backward Euler steps (M - dt L) u' = M u with
+// dt = (sigma_l^2 - sigma_(l-1)^2) / (2 num_substeps), a single step would give a kernel with too heavy tails.
+// All systems share the sparsity pattern of L, it is analyzed once and refactorized numerically per level, so
+// the cost does not depend on sigma. Averages are area weighted (M) instead of vertex count weighted.
+static void heatDiffusionPyramid(const CotanLaplacian& operators, const Eigen::VectorXd& mean_curvatures, const std::vector<double>& sigmas, Eigen::MatrixXd& G_pyr)
+{
+	const int num_substeps = 4;
+	Eigen::SparseMatrix<double> A;
+	operators.combine(1.0, -1.0, A);
+	Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+	solver.analyzePattern(A);
+	Eigen::VectorXd u = mean_curvatures;
+	// the solver permutes the right hand side into its result, so M u needs its own buffer
+	Eigen::VectorXd rhs(u.size());
+	double t = 0.0;
+	for (std::size_t l = 0; l < sigmas.size(); ++l)
+	{
+		const double dt = (0.5 * sigmas[l] * sigmas[l] - t) / num_substeps;
+		if (dt > 0.0)
+		{
+			operators.combine(1.0, -dt, A);
+			solver.factorize(A);
+			if (solver.info() != Eigen::Success)
+				throw std::runtime_error("Mesh saliency: factorization of the heat diffusion system failed.\n");
+			for (int step = 0; step < num_substeps; ++step)
+			{
+				rhs = operators.masses().cwiseProduct(u);
+				u = solver.solve(rhs);
+			}
+			t = 0.5 * sigmas[l] * sigmas[l];
+		}
+		G_pyr.col(static_cast<Eigen::DenseIndex>(l)) = u;
+	}
+}
 
-void calculateMeshSaliency(const Mesh& mesh, double scale_base, std::size_t start_scale, std::size_t end_scale, Eigen::VectorXd& vertex_saliency, ScaleType scale_type)
+template <typename Scalar>
+void calculateMeshSaliency(const MeshT<Scalar>& mesh, double scale_base, std::size_t start_scale, std::size_t end_scale, Eigen::VectorXd& vertex_saliency, ScaleType scale_type, SmoothingType smoothing_type, std::size_t num_threads)
 {
 	vertex_saliency.resize(mesh.vertices().rows());
 	vertex_saliency.setZero();
-	// first compute mean curvature
+	// first compute mean curvature (in double, the cotangent weights of thin triangles need it)
 	std::cout << "Calculating mean curvature...\n";
-	Eigen::SparseMatrix<double> L, M, Minv;
-	igl::cotmatrix(mesh.vertices(), mesh.faces(), L);
-	igl::massmatrix(mesh.vertices(), mesh.faces(), igl::MASSMATRIX_TYPE_VORONOI, M);
-	igl::invert_diag(M, Minv);
-	Eigen::MatrixXd mean_curvature_normals = -Minv * (L * mesh.vertices());
+	const points_t vertices = mesh.vertices().template cast<double>();
+	const CotanLaplacian& operators = mesh.cotan_laplacian();
+	Eigen::MatrixXd mean_curvature_normals = -(operators.masses().cwiseInverse().asDiagonal() * (operators.laplacian() * vertices));
 	Eigen::VectorXd mean_curvatures = mean_curvature_normals.rowwise().norm();
 
 	//DEBUG
@@ -34,44 +175,37 @@ void calculateMeshSaliency(const Mesh& mesh, double scale_base, std::size_t star
 	Eigen::MatrixXd vertex_saliencies(mesh.vertices().rows(), static_cast<Eigen::DenseIndex>(numscales));
 
 	// calculate aabb of vertices
-	Eigen::Vector3d aabb_min = mesh.vertices().colwise().minCoeff().transpose();
-	Eigen::Vector3d aabb_max = mesh.vertices().colwise().maxCoeff().transpose();
+	Eigen::Vector3d aabb_min = vertices.colwise().minCoeff().transpose();
+	Eigen::Vector3d aabb_max = vertices.colwise().maxCoeff().transpose();
 	double aabb_diag = (aabb_max - aabb_min).norm();
 	double epsilon = aabb_diag * scale_base;
 
-	// iterate through all scales and compute per-scale vertex saliencies
-	Eigen::MatrixXd G_pyr(mesh.vertices().rows(), static_cast<Eigen::DenseIndex>(numscales + 1));
-	std::cout << "Calculating gaussian pyramid...\n";
-	std::vector<std::pair<long long, double>> rad_search_res;
-	for (std::size_t scale = start_scale; scale <= (end_scale + 1); ++scale)
-	{				
-		Eigen::DenseIndex scaleidx = static_cast<Eigen::DenseIndex>(scale - start_scale);
-		std::cout << "Level " << std::to_string(scaleidx) << "\n";
-		double cur_sigma;
+	// sigma of every pyramid level, non-decreasing with the level
+	Eigen::DenseIndex numlevels = static_cast<Eigen::DenseIndex>(numscales + 1);
+	std::vector<double> sigmas(static_cast<std::size_t>(numlevels), 0.0);
+	for (Eigen::DenseIndex scaleidx = 0; scaleidx < numlevels; ++scaleidx)
+	{
 		if (scale_type == ScaleType::DOUBLE_SIGMA_EVERY_SCALE)
-			cur_sigma = static_cast<double>(start_scale) * epsilon * static_cast<double>(Eigen::DenseIndex(1) << scaleidx);
-		else if(scale_type == ScaleType::LINEAR_INCREASE)
-			cur_sigma = static_cast<double>(start_scale) * epsilon * static_cast<double>(scaleidx + 1);
+			sigmas[scaleidx] = static_cast<double>(start_scale) * epsilon * static_cast<double>(Eigen::DenseIndex(1) << scaleidx);
+		else if (scale_type == ScaleType::LINEAR_INCREASE)
+			sigmas[scaleidx] = static_cast<double>(start_scale) * epsilon * static_cast<double>(scaleidx + 1);
+	}
 
-		for (Eigen::DenseIndex v = 0; v < mesh.vertices().rows(); ++v)
-		{
-			double query_point[] = { mesh.vertices()(v, 0), mesh.vertices()(v, 1), mesh.vertices()(v, 2) };
-			// calculate G_fine; gaussian weighted average of mean curvature with sdev scale * epsilon			
-			rad_search_res.clear();			
-			mesh.kdtree().index->radiusSearch(&query_point[0], (2.0 * cur_sigma) * (2.0 * cur_sigma), rad_search_res, nanoflann::SearchParams(0, 0.0, false));			
-			double weight = 0.0;
-			double g = 0.0;
-			for (size_t i = 0; i < rad_search_res.size(); ++i)
-			{
-				double w = std::exp(-rad_search_res[i].second / (2.0 * cur_sigma * cur_sigma));
-				g += mean_curvatures(rad_search_res[i].first) * w;
-				weight += w;
-			}
-			if (weight != 0.0)
-				G_pyr(v, scaleidx) = g / weight;
-			else
-				G_pyr(v, scaleidx) = 0.0;
-		}
+	Eigen::MatrixXd G_pyr(mesh.vertices().rows(), numlevels);
+	if (smoothing_type == SmoothingType::HEAT_DIFFUSION)
+	{
+		std::cout << "Calculating gaussian pyramid by heat diffusion (" << numlevels << " levels)...\n";
+		heatDiffusionPyramid(operators, mean_curvatures, sigmas, G_pyr);
+	}
+	else if (smoothing_type == SmoothingType::HIERARCHICAL)
+	{
+		std::cout << "Calculating gaussian pyramid from octree aggregates (" << numlevels << " levels)...\n";
+		hierarchicalPyramid(mesh, mean_curvatures, sigmas, num_threads, G_pyr);
+	}
+	else
+	{
+		std::cout << "Calculating gaussian pyramid (" << numlevels << " levels)...\n";
+		radiusSearchPyramid(mesh, mean_curvatures, sigmas, scale_type == ScaleType::DOUBLE_SIGMA_EVERY_SCALE, num_threads, G_pyr);
 	}
 
 	std::cout << "Calculating DoG scales...\n";
@@ -104,15 +238,16 @@ void calculateMeshSaliency(const Mesh& mesh, double scale_base, std::size_t star
 		size_t num_local_maxima = 0;
 
 		std::cout << "Calculating mean local maximum...\n";
+		const IndexLists& adjacency = mesh.adjacency_list();
 		for (Eigen::DenseIndex v = 0; v < vertex_saliencies.rows(); ++v)
 		{
 			// if center vertex v is greater than neighbourhood, it is a local maximum
 			if (v != global_maximum_idx)
 			{
 				bool is_local_maximum = true;
-				for (std::size_t i = 0; i < mesh.adjacency_list()[static_cast<std::size_t>(v)].size(); ++i)
+				for (int n : adjacency[static_cast<std::size_t>(v)])
 				{
-					if (vertex_saliencies(mesh.adjacency_list()[static_cast<std::size_t>(v)][i], static_cast<Eigen::DenseIndex>(scale - start_scale)) > vertex_saliencies(v, static_cast<Eigen::DenseIndex>(scale - start_scale)))
+					if (vertex_saliencies(n, static_cast<Eigen::DenseIndex>(scale - start_scale)) > vertex_saliencies(v, static_cast<Eigen::DenseIndex>(scale - start_scale)))
 					{
 						is_local_maximum = false;
 						break;
@@ -139,22 +274,24 @@ void calculateMeshSaliency(const Mesh& mesh, double scale_base, std::size_t star
 	vertex_saliency = vertex_saliencies.rowwise().sum();
 }
 
-void MeshSamplers::MeshSaliencySampler::sampleMeshPoints(const Mesh & mesh, Eigen::MatrixXd & sampled_points, Eigen::MatrixXd & sampled_normals)
+template <typename Scalar>
+void MeshSamplers::MeshSaliencySampler::sampleMeshPoints(const MeshT<Scalar> & mesh, PointMatrix<Scalar> & sampled_points, PointMatrix<Scalar> & sampled_normals)
 {
 	Eigen::VectorXd mesh_saliency;
-	calculateMeshSaliency(mesh, m_scale_base, m_start_scale, m_end_scale, mesh_saliency, m_scale_type);
+	calculateMeshSaliency(mesh, m_scale_base, m_start_scale, m_end_scale, mesh_saliency, m_scale_type, m_smoothing_type, m_num_threads);
 
 	// search local minima, sort by saliency and return the best 90% or so
 	// local maxima: do simple non maximum suppression based on one ring neighbourhood
 	size_t num_local_maxima = 0;
 	std::vector<std::pair<Eigen::DenseIndex, double>> local_maxima(static_cast<size_t>(mesh.vertices().rows() / 10));
+	const IndexLists& adjacency = mesh.adjacency_list();
 
 	for (Eigen::DenseIndex v = 0; v < mesh_saliency.rows(); ++v)
 	{		
 		bool is_local_maximum = true;
-		for (std::size_t i = 0; i < mesh.adjacency_list()[static_cast<std::size_t>(v)].size(); ++i)
+		for (int n : adjacency[static_cast<std::size_t>(v)])
 		{
-			if (mesh_saliency(mesh.adjacency_list()[static_cast<std::size_t>(v)][i]) > mesh_saliency(v))
+			if (mesh_saliency(n) > mesh_saliency(v))
 			{
 				is_local_maximum = false;
 				break;
@@ -189,31 +326,33 @@ void MeshSamplers::MeshSaliencySampler::sampleMeshPoints(const Mesh & mesh, Eige
 		igl::jet((1.0 + mesh_saliency.array()).log().matrix(), true, C);
 
 		igl::opengl::glfw::Viewer view;
-		view.data().set_mesh(mesh.vertices(), mesh.faces());
+		view.data().set_mesh(toMatrixXd(mesh.vertices()), mesh.faces());
 		view.data().set_colors(C);
 		view.data().point_size = 5.0;
-		view.data().set_points(sampled_points, Eigen::RowVector3d(1.0, 0.0, 0.0));
+		view.data().set_points(toMatrixXd(sampled_points), Eigen::RowVector3d(1.0, 0.0, 0.0));
 
 		view.launch();
 	}
 }
 
-void MeshSamplers::MeshSaliencySampler::sampleMeshPoints(const Mesh & mesh, Eigen::MatrixXd & sampled_points, Eigen::MatrixXd & sampled_normals, Eigen::VectorXd & _mesh_saliency)
+template <typename Scalar>
+void MeshSamplers::MeshSaliencySampler::sampleMeshPoints(const MeshT<Scalar> & mesh, PointMatrix<Scalar> & sampled_points, PointMatrix<Scalar> & sampled_normals, Eigen::VectorXd & _mesh_saliency)
 {
 	Eigen::VectorXd mesh_saliency;
-	calculateMeshSaliency(mesh, m_scale_base, m_start_scale, m_end_scale, mesh_saliency, m_scale_type);
+	calculateMeshSaliency(mesh, m_scale_base, m_start_scale, m_end_scale, mesh_saliency, m_scale_type, m_smoothing_type, m_num_threads);
 
 	// search local minima, sort by saliency and return the best 90% or so
 	// local maxima: do simple non maximum suppression based on one ring neighbourhood
 	size_t num_local_maxima = 0;
 	std::vector<std::pair<Eigen::DenseIndex, double>> local_maxima(static_cast<size_t>(mesh.vertices().rows() / 10));
+	const IndexLists& adjacency = mesh.adjacency_list();
 
 	for (Eigen::DenseIndex v = 0; v < mesh_saliency.rows(); ++v)
 	{
 		bool is_local_maximum = true;
-		for (std::size_t i = 0; i < mesh.adjacency_list()[static_cast<std::size_t>(v)].size(); ++i)
+		for (int n : adjacency[static_cast<std::size_t>(v)])
 		{
-			if (mesh_saliency(mesh.adjacency_list()[static_cast<std::size_t>(v)][i]) > mesh_saliency(v))
+			if (mesh_saliency(n) > mesh_saliency(v))
 			{
 				is_local_maximum = false;
 				break;
@@ -252,11 +391,18 @@ void MeshSamplers::MeshSaliencySampler::sampleMeshPoints(const Mesh & mesh, Eige
 		igl::jet((1.0 + mesh_saliency.array()).log().matrix(), true, C);
 
 		igl::opengl::glfw::Viewer view;
-		view.data().set_mesh(mesh.vertices(), mesh.faces());
+		view.data().set_mesh(toMatrixXd(mesh.vertices()), mesh.faces());
 		view.data().set_colors(C);
 		view.data().point_size = 5.0;
-		view.data().set_points(sampled_points, Eigen::RowVector3d(1.0, 0.0, 0.0));
+		view.data().set_points(toMatrixXd(sampled_points), Eigen::RowVector3d(1.0, 0.0, 0.0));
 
 		view.launch();
 	}
 }
+
+template void calculateMeshSaliency<double>(const Mesh&, double, std::size_t, std::size_t, Eigen::VectorXd&, ScaleType, SmoothingType, std::size_t);
+template void calculateMeshSaliency<float>(const Meshf&, double, std::size_t, std::size_t, Eigen::VectorXd&, ScaleType, SmoothingType, std::size_t);
+template void MeshSamplers::MeshSaliencySampler::sampleMeshPoints<double>(const Mesh&, points_t&, points_t&);
+template void MeshSamplers::MeshSaliencySampler::sampleMeshPoints<float>(const Meshf&, pointsf_t&, pointsf_t&);
+template void MeshSamplers::MeshSaliencySampler::sampleMeshPoints<double>(const Mesh&, points_t&, points_t&, Eigen::VectorXd&);
+template void MeshSamplers::MeshSaliencySampler::sampleMeshPoints<float>(const Meshf&, pointsf_t&, pointsf_t&, Eigen::VectorXd&);
@@ -1,18 +1,20 @@
 #include "..\include\tooth_segmentation.h"
 #include <iostream>
 #include <igl/opengl/glfw/Viewer.h>
-#include <igl/cotmatrix.h>
-#include <igl/invert_diag.h>
+#include <cotan_laplacian.h>
+#include <harmonic_field_solver.h>
+#include <parallel.h>
 #include <igl/jet.h>
 #include <vector>
 #include <random>
 #include <Eigen/Sparse>
 #include <cmath>
+#include <algorithm>
+#include <stdexcept>
 //#include <Eigen/SparseQR>
 #include <persistence1d.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
-#include<Eigen/IterativeLinearSolvers>
 
 void ToothSegmentation::segmentTeethFromMesh(const Mesh& mesh, const Eigen::Vector3d& approximate_mesh_up, const Eigen::Vector3d& mesh_right, std::vector<Mesh>& tooth_meshes, const ToothSegmentation::CuspDetectionParams& cuspd_params, const HarmonicFieldParams& hf_params, const MeanCurvatureParams& mc_params, const ToothMeshExtractionParams& tme_params, bool visualize_steps)
 {
@@ -126,7 +128,9 @@ void ToothSegmentation::segmentTeethFromMesh(const Mesh& mesh, const Eigen::Vect
 	//// harmonic field stuff
 	std::cout << "Solving harmonic field...\n";
 	Eigen::VectorXd harmonic_field;
-	calculateHarmonicField(working_mesh, cut_mean_curvature, tooth_features, cut_indices, harmonic_field, hf_params, visualize_steps);
+	std::cout << "Analysing laplacian matrix...\n";
+	HarmonicFieldSolver hf_solver(working_mesh.shared_cotan_laplacian(), harmonicFieldConstraints(tooth_features, cut_indices), hf_params.solver);
+	calculateHarmonicField(hf_solver, working_mesh, cut_mean_curvature, tooth_features, cut_indices, harmonic_field, hf_params, visualize_steps);
 
 	if (visualize_steps)
 	{
@@ -146,29 +150,58 @@ void ToothSegmentation::segmentTeethFromMesh(const Mesh& mesh, const Eigen::Vect
 
 void ToothSegmentation::computeMeanCurvature(const Mesh & mesh, Eigen::VectorXd & mean_curvature, const MeanCurvatureParams & mc_params, bool visualize_steps)
 {
-	// calculate mean curvature
+	// calculate mean curvature; a copy of the mesh's operators keeps its sparsity pattern while the vertices
+	// move, so the smoothing below only refills their values
 	std::cout << "- Calculating mean curvature...\n";
-	Eigen::SparseMatrix<double> L, M, Minv;
-	igl::cotmatrix(mesh.vertices(), mesh.faces(), L);
-	igl::massmatrix(mesh.vertices(), mesh.faces(), igl::MASSMATRIX_TYPE_VORONOI, M);
-	igl::invert_diag(M, Minv);
-	Eigen::MatrixXd mean_curvature_normals = -Minv * (L * mesh.vertices());
+	CotanLaplacian operators(mesh.cotan_laplacian());
+	const auto meanCurvatureNormals = [&operators](const points_t& vertices) -> Eigen::MatrixXd
+	{
+		return -(operators.masses().cwiseInverse().asDiagonal() * (operators.laplacian() * vertices));
+	};
+	Eigen::MatrixXd mean_curvature_normals = meanCurvatureNormals(mesh.vertices());
 
 	// smooth the mesh to make curvature estimate less noisy
-	Eigen::MatrixXd smoothed_vertices(mesh.vertices());
-	Eigen::MatrixXd smoothed_normals(mesh.normals());
-	if (mc_params.smoothing_steps > 0)
+	points_t smoothed_vertices(mesh.vertices());
+	points_t smoothed_normals(mesh.normals());
+	if (mc_params.smoothing_steps > 0 && mc_params.smoothing_scheme == SmoothingScheme::EXPLICIT)
 	{
 		std::cout << "- Smooothing the mesh to make the curvature estimate less noisy...\n";
 		for (std::size_t i = 0; i < mc_params.smoothing_steps; ++i)
 		{
 			std::cout << "Iteration " << i << "\n";
 			smoothed_vertices.array() -= mean_curvature_normals.array() * mc_params.smoothing_step_size;
-			igl::cotmatrix(smoothed_vertices, mesh.faces(), L);
-			igl::massmatrix(smoothed_vertices, mesh.faces(), igl::MASSMATRIX_TYPE_VORONOI, M);
-			igl::invert_diag(M, Minv);
-			mean_curvature_normals = -Minv * (L * smoothed_vertices);
+			operators.assemble(smoothed_vertices);
+			mean_curvature_normals = meanCurvatureNormals(smoothed_vertices);
+		}
+	}
+	else if (mc_params.smoothing_steps > 0)
+	{
+		// backward Euler (M - dt L) x' = M x: unconditionally stable, so a few large steps cover the smoothing time
+		// of all explicit steps. M - dt L is SPD with a condition number of about 1 + dt * (largest eigenvalue of
+		// M^-1 L), small for smoothing times of a few squared edge lengths, so Jacobi preconditioned CG started at
+		// the current vertices converges in a few dozen iterations and beats factorizing. Between the steps the
+		// operators are refilled in place.
+		const std::size_t num_steps = std::max<std::size_t>(mc_params.implicit_steps, 1);
+		const double dt = mc_params.smoothing_steps * mc_params.smoothing_step_size / static_cast<double>(num_steps);
+		std::cout << "- Smooothing the mesh to make the curvature estimate less noisy (" << num_steps << " implicit steps)...\n";
+		Eigen::SparseMatrix<double> A;
+		Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper> solver;
+		solver.setTolerance(1e-10);
+		for (std::size_t i = 0; i < num_steps; ++i)
+		{
+			if (i > 0)
+				operators.assemble(smoothed_vertices);
+			operators.combine(1.0, -dt, A);
+			solver.compute(A);
+			const Eigen::MatrixXd rhs = operators.masses().asDiagonal() * smoothed_vertices;
+			const Eigen::MatrixXd guess = smoothed_vertices;
+			smoothed_vertices = solver.solveWithGuess(rhs, guess);
+			if (solver.info() != Eigen::Success)
+				throw std::runtime_error("Mean curvature: implicit smoothing step did not converge.\n");
+			std::cout << "Step " << i << ": " << solver.iterations() << " CG iterations\n";
 		}
+		operators.assemble(smoothed_vertices);
+		mean_curvature_normals = meanCurvatureNormals(smoothed_vertices);
 	}
 
 	// recalculate normals
@@ -263,14 +296,15 @@ void ToothSegmentation::computeCusps(const Mesh & mesh, const Eigen::Vector3d &
 
 	size_t num_local_maxima = 0;
 	std::vector<std::pair<Eigen::DenseIndex, double>> local_maxima;
+	const IndexLists& adjacency = mesh.adjacency_list();
 
 	for (Eigen::DenseIndex v = 0; v < active_indices.rows(); ++v)
 	{
 		Eigen::DenseIndex i = active_indices(v);
 		bool is_local_maximum = true;
-		for (std::size_t j = 0; j < mesh.adjacency_list()[static_cast<std::size_t>(i)].size(); ++j)
+		for (int j : adjacency[static_cast<std::size_t>(i)])
 		{
-			if (weights(mesh.adjacency_list()[static_cast<std::size_t>(i)][j]) > weights(i))
+			if (weights(j) > weights(i))
 			{
 				is_local_maximum = false;
 				break;
@@ -289,20 +323,21 @@ void ToothSegmentation::computeCusps(const Mesh & mesh, const Eigen::Vector3d &
 		return a.second > b.second;
 	});
 
-	// extract a fraction of the best local maxima for optimum shift
+	// to make indexing faster make a compact copy of the active vertices and weights
+	points_t active_vertices(mesh.vertices()(active_indices, Eigen::all));
+	Eigen::VectorXd active_weights(weights(active_indices));
+	std::vector<int> active_index_of(static_cast<std::size_t>(mesh.vertices().rows()), -1);
+	for (Eigen::DenseIndex v = 0; v < active_indices.rows(); ++v)
+		active_index_of[static_cast<std::size_t>(active_indices(v))] = static_cast<int>(v);
+
+	// extract a fraction of the best local maxima for optimum shift; a particle sits on an active vertex and is kept
+	// as its index
 	Eigen::DenseIndex num_filtered_maxima = std::min(std::max(static_cast<Eigen::DenseIndex>(cuspd_params.os_frac * static_cast<double>(local_maxima.size()) + 0.5), static_cast<Eigen::DenseIndex>(1)), static_cast<Eigen::DenseIndex>(local_maxima.size()));
-	Eigen::MatrixXd particles(num_filtered_maxima, 3);
+	std::vector<int> particles(static_cast<std::size_t>(num_filtered_maxima));
 	for (Eigen::DenseIndex p = 0; p < num_filtered_maxima; ++p)
-	{
-		particles.row(p) = mesh.vertices().row(local_maxima[p].first);
-	}
+		particles[static_cast<std::size_t>(p)] = active_index_of[static_cast<std::size_t>(local_maxima[p].first)];
 
-	std::cout << "Local maxima considered for optimum shift: " << particles.rows() << "\n";
-
-	// to make indexing faster make a compact copy of the active vertices and weights
-	Eigen::MatrixXd active_vertices(mesh.vertices()(active_indices, Eigen::all));
-	Eigen::VectorXd active_weights(weights(active_indices));
-	Eigen::VectorXd inverse_active_weights((1.0 - active_weights.array()).matrix());
+	std::cout << "Local maxima considered for optimum shift: " << particles.size() << "\n";
 
 	// build kd-tree for optimum shift
 	kdtree_t kdtree(3, active_vertices);
@@ -318,70 +353,99 @@ void ToothSegmentation::computeCusps(const Mesh & mesh, const Eigen::Vector3d &
 	double search_rad = (2.0 * h) * (2.0 * h);
 	//double mswvar = 2.0 * h * h;
 
-	// accumulates total amount of shift
-	double total_shift;
-	double querypt[3];
-
-	// shift vectors
-	Eigen::MatrixXd shift_vectors(particles.rows(), 3);
-
-	std::vector<std::pair<long long, double>> rad_search_res;
-	Eigen::RowVector3d mean;
-	double normalizer;
-	Eigen::DenseIndex nbidx;
-	for (std::size_t t = 0; t < cuspd_params.os_max_iterations; ++t)
+	// every step moves a particle to the vertex of largest weight in its window (ties keep it in place, then the
+	// lower index wins), so the path from a vertex is always the same: a particle stepping onto a vertex another
+	// particle has visited merges into that one, and a particle whose own shift is below os_min_total_shift is frozen.
+	// Only the moving particles search, in parallel.
+	std::vector<int> visited_by(static_cast<std::size_t>(active_vertices.rows()), -1);
+	std::vector<int> moving;
+	for (std::size_t p = 0; p < particles.size(); ++p)
 	{
-		std::cout << "Optimum-shift iteration " << t + 1 << "\n";
-
-		shift_vectors.setZero();
-		for (Eigen::DenseIndex p = 0; p < particles.rows(); ++p)
+		int& owner = visited_by[static_cast<std::size_t>(particles[p])];
+		if (owner < 0)
 		{
-			rad_search_res.clear();
-			querypt[0] = particles(p, 0);
-			querypt[1] = particles(p, 1);
-			querypt[2] = particles(p, 2);
-
-			kdtree.index->radiusSearch(querypt, search_rad, rad_search_res, radsearchparam);
-
-			mean.setZero();
-			normalizer = std::numeric_limits<double>::lowest();
-			for (std::size_t r = 0; r < rad_search_res.size(); ++r)
+			owner = static_cast<int>(p);
+			moving.push_back(static_cast<int>(p));
+		}
+	}
+	std::vector<char> merged(particles.size(), 1);
+	for (int p : moving)
+		merged[static_cast<std::size_t>(p)] = 0;
+	std::size_t num_merged = particles.size() - moving.size();
+	std::size_t num_frozen = 0;
+	std::size_t num_iterations = 0;
+	std::vector<int> targets;
+	while (!moving.empty() && num_iterations < cuspd_params.os_max_iterations)
+	{
+		++num_iterations;
+		targets.resize(moving.size());
+#pragma omp parallel num_threads(Parallel::numThreads())
+		{
+			std::vector<std::pair<long long, double>> rad_search_res;
+#pragma omp for schedule(dynamic, 16)
+			for (Eigen::Index m = 0; m < static_cast<Eigen::Index>(moving.size()); ++m)
 			{
-				nbidx = rad_search_res[r].first;
-				if (active_weights(nbidx) > normalizer)
+				const int v = particles[static_cast<std::size_t>(moving[static_cast<std::size_t>(m)])];
+				rad_search_res.clear();
+				kdtree.index->radiusSearch(active_vertices.row(v).data(), search_rad, rad_search_res, radsearchparam);
+				int best = v;
+				for (const auto& neighbour : rad_search_res)
 				{
-					mean = active_vertices(nbidx, Eigen::all);
-					normalizer = active_weights(nbidx);
+					const int n = static_cast<int>(neighbour.first);
+					if (active_weights(n) > active_weights(best) || (active_weights(n) == active_weights(best) && best != v && n < best))
+						best = n;
 				}
+				targets[static_cast<std::size_t>(m)] = best;
 			}
-			shift_vectors(p, Eigen::all) = mean - particles(p, Eigen::all);
 		}
 
-		// shift all particles
-		particles.array() += shift_vectors.array();
-		total_shift = shift_vectors.rowwise().norm().sum();
-
-		if (total_shift < cuspd_params.os_min_total_shift)
+		double total_shift = 0.0;
+		std::size_t num_moving = 0;
+		for (std::size_t m = 0; m < moving.size(); ++m)
 		{
-			break;
+			const int p = moving[m];
+			const int target = targets[m];
+			const double shift = (active_vertices.row(target) - active_vertices.row(particles[static_cast<std::size_t>(p)])).norm();
+			total_shift += shift;
+			if (shift < cuspd_params.os_min_total_shift)
+			{
+				++num_frozen;
+				continue;
+			}
+			particles[static_cast<std::size_t>(p)] = target;
+			int& owner = visited_by[static_cast<std::size_t>(target)];
+			if (owner >= 0 && owner != p)
+			{
+				merged[static_cast<std::size_t>(p)] = 1;
+				++num_merged;
+				continue;
+			}
+			owner = p;
+			moving[num_moving++] = p;
 		}
+		moving.resize(num_moving);
+		std::cout << "Optimum-shift iteration " << num_iterations << ": " << moving.size() << " moving, " << num_frozen << " converged, " << num_merged << " merged\n";
+		if (total_shift < cuspd_params.os_min_total_shift)
+			break;
 	}
+	std::cout << "Optimum shift: " << num_iterations << " iterations, " << particles.size() - num_merged << " particles (" << moving.size() << " not converged)\n";
 
 	// collapse features with distance < threshold
 	std::cout << "Merging features...\n";
-	std::vector<bool> duplmap;
-	for (Eigen::DenseIndex i = 0; i < particles.rows(); ++i)
+	std::vector<int> remaining;
+	for (std::size_t p = 0; p < particles.size(); ++p)
 	{
-		duplmap.push_back(false);
+		if (!merged[p])
+			remaining.push_back(particles[p]);
 	}
-
-	for (Eigen::DenseIndex i = 0; i < particles.rows(); ++i)
+	std::vector<bool> duplmap(remaining.size(), false);
+	for (std::size_t i = 0; i < remaining.size(); ++i)
 	{
-		for (Eigen::DenseIndex j = 0; j < particles.rows(); ++j)
+		for (std::size_t j = 0; j < remaining.size(); ++j)
 		{
 			if (i != j && !duplmap[i])
 			{
-				if (((particles(i, Eigen::all) - particles(j, Eigen::all)).norm() < (cuspd_params.ft_collapse_dist * aabb_diag)) && (!duplmap[j]))
+				if (((active_vertices.row(remaining[i]) - active_vertices.row(remaining[j])).norm() < (cuspd_params.ft_collapse_dist * aabb_diag)) && (!duplmap[j]))
 				{
 					duplmap[j] = true;
 				}
@@ -396,18 +460,13 @@ void ToothSegmentation::computeCusps(const Mesh & mesh, const Eigen::Vector3d &
 			numfeatures++;
 	}
 
+	// particles sit on active vertices, so the feature is the vertex itself
 	features.resize(numfeatures);
 	Eigen::DenseIndex ftct = 0;
-	for (Eigen::DenseIndex i = 0; i < static_cast<Eigen::DenseIndex>(duplmap.size()); ++i)
+	for (std::size_t i = 0; i < duplmap.size(); ++i)
 	{
 		if (!duplmap[i])
-		{
-			double qp[] = { particles(i, 0), particles(i, 1), particles(i, 2) };
-			Eigen::Index closestidx;
-			double dist;
-			mesh.kdtree().query(qp, 1, &closestidx, &dist);
-			features(ftct++) = closestidx;
-		}
+			features(ftct++) = active_indices(remaining[i]);
 	}
 
 	// remove features with low local neighborhood (essentially removes too small features)
@@ -416,15 +475,12 @@ void ToothSegmentation::computeCusps(const Mesh & mesh, const Eigen::Vector3d &
 	search_rad = sftr_window_size * sftr_window_size;
 	double ft_mean = weights(features.array()).mean();
 	std::vector<Eigen::DenseIndex> final_features;
+	std::vector<std::pair<long long, double>> rad_search_res;
 	//Eigen::VectorXd sizeweight(features.rows());
 	for (Eigen::DenseIndex i = 0; i < features.rows(); ++i)
 	{
 		rad_search_res.clear();
-		querypt[0] = mesh.vertices()(features(i), 0);
-		querypt[1] = mesh.vertices()(features(i), 1);
-		querypt[2] = mesh.vertices()(features(i), 2);
-
-		mesh.kdtree().index->radiusSearch(querypt, search_rad, rad_search_res, radsearchparam);
+		mesh.kdtree().index->radiusSearch(mesh.vertices().row(features(i)).data(), search_rad, rad_search_res, radsearchparam);
 
 		double mean_nb_score = 0.0;
 		for (size_t s = 0; s < rad_search_res.size(); ++s)
@@ -462,82 +518,52 @@ void ToothSegmentation::computeCusps(const Mesh & mesh, const Eigen::Vector3d &
 	}
 }
 
-void ToothSegmentation::calculateHarmonicField(const Mesh& mesh, const Eigen::VectorXd& mean_curvature, const std::vector<ToothFeature>& toothFeatures, const Eigen::VectorXi& cutIndices, Eigen::VectorXd& harmonic_field, const HarmonicFieldParams& hf_params, bool visualize_steps)
+void ToothSegmentation::calculateHarmonicField(HarmonicFieldSolver& solver, const Mesh& mesh, const Eigen::VectorXd& mean_curvature, const std::vector<ToothFeature>& toothFeatures, const Eigen::VectorXi& cutIndices, Eigen::VectorXd& harmonic_field, const HarmonicFieldParams& hf_params, bool visualize_steps)
 {
-	std::cout << "Building laplacian matrix...\n";
-	// sort indices by constraint type
-	// tooth features
-	Eigen::Index num_tooth_features = 0;
-	for (const auto& t : toothFeatures)
-		num_tooth_features += t.numFeaturePoints;
-
-	// calculate laplacian matrix
-	Eigen::SparseMatrix<double> L(mesh.vertices().rows(), mesh.vertices().rows());
-	L.setZero();
-	Eigen::VectorXd b(mesh.vertices().rows());	
-	b.setZero();
-
-	std::vector<Eigen::Triplet<double>> Ltripls;
-
-	double max_curvature = mean_curvature.maxCoeff();
-	double min_curvature = mean_curvature.minCoeff();
-	for (Eigen::Index i = 0; i < mesh.vertices().rows(); ++i)
-	{
-		double iweight = 0.0;
-		for (Eigen::Index a = 0; a < mesh.adjacency_list()[i].size(); ++a)
-		{
-			Eigen::Index j = mesh.adjacency_list()[i][a];			
-			double cotij = calcCotanWeight(i, j, mesh) * calcCurvatureWeight(i, j, mean_curvature, hf_params);
-			Ltripls.push_back(Eigen::Triplet<double>(i, j, -cotij));
-			iweight += cotij;
-		}
-		Ltripls.push_back(Eigen::Triplet<double>(i, i, iweight));
-	}
-	std::cout << "L non-zero entries: " << Ltripls.size() << "\n";
-	std::cout << "Num vertices: " << mesh.vertices().rows() << "\n";
+	// constraints: features of even / odd teeth at 0 / w, the cut boundary at w / 2 (it wins over a feature)
+	checkHarmonicFieldSolver(solver, mesh, toothFeatures, cutIndices);
+	std::cout << "Num vertices: " << mesh.vertices().rows() << ", free: " << solver.numFree() << "\n";
 
-	L.setFromTriplets(Ltripls.begin(), Ltripls.end());
-
-	// mass matrix to account for triangulation
-	Eigen::SparseMatrix<double> M, Minv;
-	igl::massmatrix(mesh.vertices(), mesh.faces(), igl::MASSMATRIX_TYPE_VORONOI, M);
-	igl::invert_diag(M, Minv);
-	L = Minv * L;
-
-	std::cout << "Applying constraints...\n";
-	// tooth features
-	std::cout << "Tooth features...\n";
-	for (Eigen::Index t = 0; t < toothFeatures.size(); ++t)
+	Eigen::VectorXd vertex_values = Eigen::VectorXd::Zero(mesh.vertices().rows());
+	for (std::size_t t = 0; t < toothFeatures.size(); ++t)
 	{
 		for (Eigen::Index i = 0; i < toothFeatures[t].numFeaturePoints; ++i)
-		{
-			L.row(toothFeatures[t].featurePointIndices[i]) *= 0.0;
-			L.coeffRef(toothFeatures[t].featurePointIndices[i], toothFeatures[t].featurePointIndices[i]) = 1.0;
-			b(toothFeatures[t].featurePointIndices[i]) = ((t % 2 == 0) ? 0.0 : hf_params.w);
-		}
+			vertex_values(toothFeatures[t].featurePointIndices[i]) = ((t % 2 == 0) ? 0.0 : hf_params.w);
 	}
-
-	// cut boundary vertices
-	std::cout << "Cut boundary...\n";
 	for (Eigen::Index i = 0; i < cutIndices.rows(); ++i)
-	{
-		L.row(cutIndices(i)) *= 0.0;
-		L.coeffRef(cutIndices(i), cutIndices(i)) = 1.0;
-		b(cutIndices(i)) = 0.5 * hf_params.w;
-	}
+		vertex_values(cutIndices(i)) = 0.5 * hf_params.w;
+	Eigen::MatrixXd boundary_values(solver.constrained().size(), 1);
+	for (std::size_t c = 0; c < solver.constrained().size(); ++c)
+		boundary_values(static_cast<Eigen::Index>(c), 0) = vertex_values(solver.constrained()[c]);
 
-	// solve sparse system
-	std::cout << "Solving linear system...\n";
-	//Eigen::SparseQR<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>> solver;
-	Eigen::BiCGSTAB<Eigen::SparseMatrix<double>> solver;
-	solver.compute(L);
-	if (solver.info() != Eigen::Success)
+	std::cout << (solver.method() == HarmonicFieldSolver::Method::DIRECT ? "Factorizing...\n" : "Building multigrid hierarchy...\n");
+	solver.factorize([&mean_curvature, &hf_params](int i, int j)
 	{
-		std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! SPARSE QR DECOMPOSTION FAILED !!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
-		harmonic_field.resize(mesh.vertices().rows());
-		harmonic_field.setZero();
-	}
-	harmonic_field = solver.solve(b);
+		return calcCurvatureWeight(i, j, mean_curvature, hf_params);
+	});
+	std::cout << "Solving linear system...\n";
+	harmonic_field = solver.solve(boundary_values).col(0);
+}
+
+std::vector<int> ToothSegmentation::harmonicFieldConstraints(const std::vector<ToothFeature>& toothFeatures, const Eigen::VectorXi& cutIndices)
+{
+	std::vector<int> constrained;
+	for (const ToothFeature& tooth : toothFeatures)
+		constrained.insert(constrained.end(), tooth.featurePointIndices.begin(), tooth.featurePointIndices.begin() + tooth.numFeaturePoints);
+	constrained.insert(constrained.end(), cutIndices.data(), cutIndices.data() + cutIndices.size());
+	return constrained;
+}
+
+void ToothSegmentation::checkHarmonicFieldSolver(const HarmonicFieldSolver& solver, const Mesh& mesh, const std::vector<ToothFeature>& toothFeatures, const Eigen::VectorXi& cutIndices)
+{
+	// the solver keeps its constrained vertices sorted and unique
+	std::vector<int> constrained = harmonicFieldConstraints(toothFeatures, cutIndices);
+	std::sort(constrained.begin(), constrained.end());
+	constrained.erase(std::unique(constrained.begin(), constrained.end()), constrained.end());
+	// the solver co-owns its operators, so an equal owner is the current Laplacian of the mesh and not a later one
+	// allocated at the same address
+	if (solver.operators() != mesh.shared_cotan_laplacian() || constrained != solver.constrained())
+		throw std::invalid_argument("Harmonic field: solver was built for another mesh or other constraints.\n");
 }
 
 void ToothSegmentation::cutMesh(Mesh& mesh, Eigen::VectorXi& cut_indices, Eigen::VectorXi& ivrs_index_map, Eigen::VectorXi& _index_map, const Eigen::Vector3d& normal, const Eigen::Vector3d& plane_point)
@@ -588,7 +614,7 @@ void ToothSegmentation::cutMesh(Mesh& mesh, Eigen::VectorXi& cut_indices, Eigen:
 		}		
 	}
 
-	Eigen::MatrixXd Vnew(newvertices.size(), 3);
+	points_t Vnew(newvertices.size(), 3);
 	for (std::size_t i = 0; i < newvertices.size(); ++i)
 		Vnew(i, Eigen::all) = newvertices[i];
 
@@ -596,10 +622,11 @@ void ToothSegmentation::cutMesh(Mesh& mesh, Eigen::VectorXi& cut_indices, Eigen:
 	for (std::size_t i = 0; i < newfaces.size(); ++i)
 		Fnew(i, Eigen::all) = newfaces[i];
 
-	Eigen::MatrixXd Nnew;
+	points_t Nnew;
 	igl::per_vertex_normals(Vnew, Fnew, Nnew);
 
-	mesh = Mesh(Vnew, Nnew, Fnew);
+	const Eigen::Index num_new_vertices = Vnew.rows();
+	mesh = Mesh(std::move(Vnew), std::move(Nnew), std::move(Fnew));
 
 	Eigen::DenseIndex num_cut_indices = 0;
 	for (Eigen::DenseIndex i = 0; i < cutindices_old.size(); ++i)
@@ -614,7 +641,7 @@ void ToothSegmentation::cutMesh(Mesh& mesh, Eigen::VectorXi& cut_indices, Eigen:
 
 	// construct inverse index map (for handling old arrays defined over the mesh)
 	Eigen::DenseIndex ivrsidxct = 0;
-	ivrs_index_map.resize(Vnew.rows());
+	ivrs_index_map.resize(num_new_vertices);
 	for (Eigen::DenseIndex i = 0; i < index_map.rows(); ++i)
 		if(index_map(i) != -1)
 			ivrs_index_map(index_map(i)) = i;
@@ -622,47 +649,6 @@ void ToothSegmentation::cutMesh(Mesh& mesh, Eigen::VectorXi& cut_indices, Eigen:
 	_index_map = index_map;
 }
 
-double ToothSegmentation::calcCotanWeight(const Eigen::Index & i, const Eigen::Index & j, const Mesh & mesh)
-{
-	bool is_adjacent = false;
-	for (std::size_t n = 0; n < mesh.adjacency_list()[i].size(); ++n)
-	{
-		if (mesh.adjacency_list()[i][n] == j)
-		{
-			is_adjacent = true;
-		}
-	}
-
-	if (is_adjacent)
-	{
-		Eigen::Vector3d vi = mesh.vertices()(i, Eigen::all);
-		Eigen::Vector3d vj = mesh.vertices()(j, Eigen::all);
-		double res = 0.0;
-		for (Eigen::Index t = 0; t < mesh.triangle_list()[i].size(); ++t)
-		{
-			for (Eigen::Index k = 0; k < 3; ++k)
-			{
-				if (mesh.faces()(mesh.triangle_list()[i][t], k) == j)
-				{
-					for (Eigen::Index l = 0; l < 3; ++l)
-					{
-						if (mesh.faces()(mesh.triangle_list()[i][t], l) != i && mesh.faces()(mesh.triangle_list()[i][t], l) != j)
-						{
-							Eigen::Vector3d vl = mesh.vertices()(mesh.faces()(mesh.triangle_list()[i][t], l), Eigen::all);
-							res += ((vi - vl).normalized().dot((vj - vl).normalized())) / ((vi - vl).normalized().cross((vj - vl).normalized())).norm();
-						}
-					}
-				}
-			}
-		}
-		return res / 2.0;
-	}
-	else
-	{
-		return 0.0;
-	}
-}
-
 double ToothSegmentation::calcCurvatureWeight(const Eigen::Index & i, const Eigen::Index & j, const Eigen::VectorXd & mean_curvature, const HarmonicFieldParams & hf_params)
 {
 	double nmci = std::abs(std::min(mean_curvature(i), 0.0));
@@ -1076,7 +1062,7 @@ std::vector<Mesh> ToothSegmentation::extractToothMeshes(const Mesh & mesh, const
 					// add index to tooth index list
 					tooth_indices.push_back(cidx);
 					// push children onto stack
-					for (const auto& a : mesh.adjacency_list()[cidx])
+					for (int a : mesh.adjacency_list()[static_cast<std::size_t>(cidx)])
 					{
 						stack.push_back(a);
 					}
@@ -1111,7 +1097,7 @@ std::vector<Mesh> ToothSegmentation::extractToothMeshes(const Mesh & mesh, const
 			}
 		}
 
-		Eigen::MatrixXd Vnew(newvertices.size(), 3);
+		points_t Vnew(newvertices.size(), 3);
 		for (std::size_t i = 0; i < newvertices.size(); ++i)
 			Vnew(i, Eigen::all) = newvertices[i];
 
@@ -1119,10 +1105,10 @@ std::vector<Mesh> ToothSegmentation::extractToothMeshes(const Mesh & mesh, const
 		for (std::size_t i = 0; i < newfaces.size(); ++i)
 			Fnew(i, Eigen::all) = newfaces[i];
 
-		Eigen::MatrixXd Nnew;
+		points_t Nnew;
 		igl::per_vertex_normals(Vnew, Fnew, Nnew);
 
-		tooth_meshes.push_back(Mesh(Vnew, Nnew, Fnew));
+		tooth_meshes.push_back(Mesh(std::move(Vnew), std::move(Nnew), std::move(Fnew)));
 
 		if (visualize_steps)
 		{